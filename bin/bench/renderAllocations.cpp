@@ -0,0 +1,103 @@
+// ----------------------------------------------------------------------------
+// Counts the heap allocations font::font::renderCell makes per rendered cell once
+// every glyph it needs has been loaded, which should be none. Exits non-zero
+// otherwise, so it can be re-checked after touching the font code.
+//
+// Usage:
+//   meson compile -C build renderAllocations && ./build/renderAllocations [font path]
+// ----------------------------------------------------------------------------
+
+#include "../../src/font.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+static std::atomic<size_t> allocations{0};
+
+// Array and nothrow forms end up in here as well
+void* operator new(std::size_t size) {
+    allocations++;
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, std::size_t) noexcept { std::free(memory); }
+
+// The only part of the window system font.cpp calls into, for when the cell size changes
+namespace window {
+    void invalidateLayout() {}
+}
+
+static types::Cell makeCell(const char* utf8) {
+    types::Cell cell{};
+    std::memcpy(cell.utf, utf8, std::min<size_t>(std::strlen(utf8), sizeof(cell.utf)));
+    cell.textColor = {220, 220, 220};
+    cell.backgroundColor = {20, 20, 30};
+    return cell;
+}
+
+int main(int argc, char** argv) {
+    if (!font::manager::initialize(argc > 1 ? argv[1] : "")) {
+        std::fprintf(stderr, "No font to render with, pass a path to one\n");
+        return 2;
+    }
+
+    std::shared_ptr<font::font> cellFont = font::manager::getDefaultFont();
+    const int width = font::manager::getDefaultCellWidth();
+    const int height = font::manager::getDefaultCellHeight();
+
+    // Printable ASCII from the atlas, and a few codepoints which only live in the glyph cache
+    std::vector<types::Cell> cells;
+    for (char c = 0x21; c < 0x7f; c++) {
+        const char utf8[2] = {c, 0};
+        cells.push_back(makeCell(utf8));
+    }
+    for (const char* utf8 : {"λ", "Ж", "→", "∑", "♥"}) {
+        cells.push_back(makeCell(utf8));
+    }
+
+    const float zooms[] = {1.0f, 1.5f};
+    const int rounds = 1000;
+
+    font::cellRenderData rgb{width * 2, height * 2, std::vector<types::RGB>(static_cast<size_t>(width * 2) * height * 2)};
+    std::vector<uint32_t> xrgb(static_cast<size_t>(width * 2) * height * 2);
+
+    // Loads every glyph and fills the per thread zoom tables, none of which counts
+    for (float zoom : zooms) {
+        for (const types::Cell& cell : cells) {
+            rgb.width = static_cast<int>(width * zoom);
+            rgb.height = static_cast<int>(height * zoom);
+            cellFont->renderCell(cell, rgb, zoom);
+            cellFont->renderCell(cell, xrgb.data(), rgb.width, rgb.height, rgb.width, zoom);
+        }
+    }
+
+    allocations = 0;
+
+    size_t rendered = 0;
+    for (int round = 0; round < rounds; round++) {
+        for (float zoom : zooms) {
+            rgb.width = static_cast<int>(width * zoom);
+            rgb.height = static_cast<int>(height * zoom);
+            for (const types::Cell& cell : cells) {
+                cellFont->renderCell(cell, rgb, zoom);
+                cellFont->renderCell(cell, xrgb.data(), rgb.width, rgb.height, rgb.width, zoom);
+                rendered += 2;
+            }
+        }
+    }
+
+    const size_t counted = allocations.load();
+    std::printf("%zu cells rendered, %zu allocations, %.4f per cell\n", rendered, counted, static_cast<double>(counted) / static_cast<double>(rendered));
+
+    font::manager::cleanup();
+    return counted == 0 ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+#include "capture.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <filesystem>
+#include <iomanip>
+#include <new>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+namespace capture {
+    constexpr uint32_t xrgb8888 = 0x34325258;  // DRM_FORMAT_XRGB8888, spelled out so this doesn't need libdrm
+    constexpr size_t slotAlignment = 64;        // Keeps the pixel rows of every slot cache line aligned
+
+    static size_t alignUp(size_t value, size_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    mode parseMode(const std::string& name) {
+        std::string lower = name;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+        if (lower == "shm") return mode::SHM;
+        if (lower == "ppm") return mode::PPM;
+        if (lower == "raw") return mode::RAW;
+        return mode::NONE;
+    }
+
+    sink::sink(mode Target, const std::string& Path, uint32_t CrtcId, uint32_t SlotCount)
+        : target(Target), path(Path), crtcId(CrtcId), slotCount(std::max(1u, SlotCount)) {
+        if (target == mode::SHM) {
+            // POSIX shared memory names are a single component with a leading slash
+            shmName = path.empty() ? "/ggdirect-capture" : path;
+            if (shmName[0] != '/') {
+                shmName = "/" + shmName;
+            }
+            shmName += "-" + std::to_string(crtcId);
+        }
+        else if (target == mode::PPM || target == mode::RAW) {
+            if (path.empty()) {
+                path = "ggdirect-capture";
+            }
+
+            std::error_code error;
+            std::filesystem::create_directories(path, error);
+            if (error) {
+                LOG_ERROR() << "Failed to create capture directory " << path << ": " << error.message() << std::endl;
+                target = mode::NONE;
+                return;
+            }
+
+            index.open(path + "/crtc" + std::to_string(crtcId) + ".log", std::ios::out | std::ios::trunc);
+        }
+    }
+
+    sink::~sink() {
+        closeRing();
+    }
+
+    bool sink::openRing(uint32_t width, uint32_t height) {
+        const uint64_t stride = static_cast<uint64_t>(width) * sizeof(uint32_t);
+        const uint64_t pixelOffset = alignUp(sizeof(slotHeader), slotAlignment);
+        const uint64_t slotSize = alignUp(pixelOffset + stride * height, slotAlignment);
+        const size_t headerSize = alignUp(sizeof(ringHeader), slotAlignment);
+        // Never shrinks, a reader still mapping the previous layout would fault on the pages cut off
+        const size_t size = std::max(headerSize + slotSize * slotCount, ringSize);
+
+        int fd = shm_open(shmName.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+            LOG_ERROR() << "Failed to open capture ring " << shmName << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            LOG_ERROR() << "Failed to size capture ring " << shmName << " to " << size << " bytes: " << strerror(errno) << std::endl;
+            close(fd);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);  // The mapping keeps the object alive
+        if (mapping == MAP_FAILED) {
+            LOG_ERROR() << "Failed to map capture ring " << shmName << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        const bool relayout = ring != nullptr;
+        if (relayout) {
+            munmap(ring, ringSize);
+        }
+
+        ring = mapping;
+        ringSize = size;
+        ringWidth = width;
+        ringHeight = height;
+        sequence = 0;
+
+        // The header of a previous layout is still there and readers may be looking at it, so it's only rewritten in place
+        ringHeader* header = relayout ? static_cast<ringHeader*>(ring) : new (ring) ringHeader{};
+        header->generation.store(++ringGeneration, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        std::memcpy(header->magic, ringMagic, sizeof(ringMagic));
+        header->version = ringVersion;
+        header->slotCount = slotCount;
+        header->width = width;
+        header->height = height;
+        header->stride = static_cast<uint32_t>(stride);
+        header->format = xrgb8888;
+        header->slotSize = slotSize;
+        header->pixelOffset = pixelOffset;
+        header->written.store(0, std::memory_order_relaxed);
+
+        for (uint32_t slot = 0; slot < slotCount; slot++) {
+            new (static_cast<uint8_t*>(ring) + headerSize + slotSize * slot) slotHeader{};
+        }
+
+        header->generation.store(++ringGeneration, std::memory_order_release);
+
+        LOG_INFO() << "Capturing frames of CRTC " << crtcId << " into shared memory ring " << shmName << " of " << slotCount << " " << width << "x" << height << " frames" << std::endl;
+        return true;
+    }
+
+    void sink::closeRing() {
+        if (!ring) {
+            return;
+        }
+
+        munmap(ring, ringSize);
+        shm_unlink(shmName.c_str());
+
+        ring = nullptr;
+        ringSize = 0;
+        ringGeneration = 0;
+        ringWidth = 0;
+        ringHeight = 0;
+    }
+
+    bool sink::write(const void* pixels, uint32_t width, uint32_t height, uint32_t stride, uint64_t frame,
+                     std::chrono::steady_clock::time_point presented, const std::vector<types::rectangle>& damage) {
+        if (target == mode::NONE || !pixels || width == 0 || height == 0) {
+            return false;
+        }
+
+        bool written = target == mode::SHM ?
+            writeRing(pixels, width, height, stride, frame, presented, damage) :
+            writeFile(pixels, width, height, stride, frame, presented, damage);
+
+        // A sink that failed once would only flood the log, the renderer keeps going without it
+        if (!written) {
+            LOG_ERROR() << "Frame capture of CRTC " << crtcId << " failed, disabling it" << std::endl;
+            closeRing();
+            target = mode::NONE;
+        }
+
+        return written;
+    }
+
+    bool sink::writeRing(const void* pixels, uint32_t width, uint32_t height, uint32_t stride, uint64_t frame,
+                         std::chrono::steady_clock::time_point presented, const std::vector<types::rectangle>& damage) {
+        // A new geometry lays the ring out again under the same name, see ringHeader for how readers follow it
+        if ((!ring || width != ringWidth || height != ringHeight) && !openRing(width, height)) {
+            return false;
+        }
+
+        ringHeader* header = static_cast<ringHeader*>(ring);
+        const uint64_t sequenceNumber = ++sequence;
+
+        uint8_t* slot = static_cast<uint8_t*>(ring) + alignUp(sizeof(ringHeader), slotAlignment) + header->slotSize * ((sequenceNumber - 1) % slotCount);
+        slotHeader* slotInfo = reinterpret_cast<slotHeader*>(slot);
+
+        slotInfo->sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slotInfo->frame = frame;
+        slotInfo->presentedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(presented.time_since_epoch()).count();
+        slotInfo->crtcId = crtcId;
+        slotInfo->damageCount = damage.size() <= maxDamageRects ? static_cast<uint32_t>(damage.size()) : 0;
+        for (uint32_t i = 0; i < slotInfo->damageCount; i++) {
+            const types::rectangle& rect = damage[i];
+            slotInfo->damage[i] = {rect.position.x, rect.position.y, rect.size.x, rect.size.y};
+        }
+
+        const uint8_t* source = static_cast<const uint8_t*>(pixels);
+        uint8_t* destination = slot + header->pixelOffset;
+        for (uint32_t y = 0; y < height; y++) {
+            std::memcpy(destination + static_cast<size_t>(y) * header->stride, source + static_cast<size_t>(y) * stride, header->stride);
+        }
+
+        slotInfo->sequence.store(sequenceNumber, std::memory_order_release);
+        header->written.store(sequenceNumber, std::memory_order_release);
+        return true;
+    }
+
+    bool sink::writeFile(const void* pixels, uint32_t width, uint32_t height, uint32_t stride, uint64_t frame,
+                         std::chrono::steady_clock::time_point presented, const std::vector<types::rectangle>& damage) {
+        const uint64_t sequenceNumber = ++sequence;
+
+        std::stringstream name;
+        name << path << "/crtc" << crtcId << "-" << std::setw(8) << std::setfill('0') << sequenceNumber << (target == mode::PPM ? ".ppm" : ".raw");
+
+        std::ofstream file(name.str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            LOG_ERROR() << "Failed to open capture file " << name.str() << std::endl;
+            return false;
+        }
+
+        const uint8_t* source = static_cast<const uint8_t*>(pixels);
+        if (target == mode::PPM) {
+            file << "P6\n" << width << " " << height << "\n255\n";
+
+            std::vector<uint8_t> row(static_cast<size_t>(width) * 3);
+            for (uint32_t y = 0; y < height; y++) {
+                const uint32_t* line = reinterpret_cast<const uint32_t*>(source + static_cast<size_t>(y) * stride);
+                for (uint32_t x = 0; x < width; x++) {
+                    row[x * 3 + 0] = static_cast<uint8_t>(line[x] >> 16);
+                    row[x * 3 + 1] = static_cast<uint8_t>(line[x] >> 8);
+                    row[x * 3 + 2] = static_cast<uint8_t>(line[x]);
+                }
+                file.write(reinterpret_cast<const char*>(row.data()), static_cast<std::streamsize>(row.size()));
+            }
+        }
+        else {
+            for (uint32_t y = 0; y < height; y++) {
+                file.write(reinterpret_cast<const char*>(source + static_cast<size_t>(y) * stride), static_cast<std::streamsize>(width) * sizeof(uint32_t));
+            }
+        }
+
+        if (!file.good()) {
+            LOG_ERROR() << "Failed to write capture file " << name.str() << std::endl;
+            return false;
+        }
+
+        // One line per frame: sequence, frame, present time in ns, size and the damage as x,y,w,h or "full"
+        if (index.is_open()) {
+            index << sequenceNumber << " " << frame << " " << std::chrono::duration_cast<std::chrono::nanoseconds>(presented.time_since_epoch()).count()
+                  << " " << width << "x" << height;
+            if (damage.empty()) {
+                index << " full";
+            }
+            for (const types::rectangle& rect : damage) {
+                index << " " << rect.position.x << "," << rect.position.y << "," << rect.size.x << "," << rect.size.y;
+            }
+            index << "\n";
+            index.flush();
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include "types.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+Writes the frames presented in headless mode somewhere they can be checked, so the whole pipeline can be verified
+pixel by pixel and measured on machines without a GPU. Every frame carries its sequence number and the pixel
+rectangles which changed since the previous frame of the same display.
+*/
+namespace capture {
+    enum class mode {
+        NONE,
+        SHM,    // Ring of frames in a POSIX shared memory object
+        PPM,    // One binary PPM file per frame
+        RAW     // One file per frame holding the XRGB8888 rows as they are in the framebuffer
+    };
+
+    // Parses "none", "shm", "ppm" or "raw", anything else is NONE
+    mode parseMode(const std::string& name);
+
+    constexpr char ringMagic[8] = {'G', 'G', 'C', 'A', 'P', 'T', 'R', '1'};
+    constexpr uint32_t ringVersion = 2;
+    constexpr uint32_t maxDamageRects = 64;    // Frames with more damage rectangles than this are reported as fully damaged
+
+    struct damageRect {
+        int32_t x, y;
+        int32_t width, height;
+    };
+
+    /*
+    Layout of the shared memory ring, a ringHeader followed by slotCount slots of slotSize bytes each.
+    Each slot is a slotHeader followed by the pixels at pixelOffset from the start of the slot.
+
+    When the display changes size the same object is laid out again in place, it only ever grows so mappings of the
+    previous layout stay valid. generation is odd while that happens and even once done, readers wait for it to be even,
+    re-map the object at its current size whenever it differs from the one they mapped, and drop a copied frame if it
+    changed meanwhile. written starts over from zero with each layout.
+    */
+    struct ringHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t slotCount;
+        uint32_t width;
+        uint32_t height;
+        uint32_t stride;                    // In bytes
+        uint32_t format;                    // DRM fourcc, always XRGB8888
+        uint64_t slotSize;                  // In bytes, including the slot header
+        uint64_t pixelOffset;               // Of the pixels within a slot
+        std::atomic<uint64_t> generation;   // Layouts so far times two, odd while the layout is being rewritten
+        std::atomic<uint64_t> written;      // Frames written so far, frame n lives in slot (n - 1) % slotCount
+    };
+
+    /*
+    Written seqlock style: sequence is 0 while the slot is being written and the sequence number of its frame once it's
+    done. A reader copies the slot and then checks that sequence is still the same non-zero value it read before.
+    */
+    struct slotHeader {
+        std::atomic<uint64_t> sequence;
+        uint64_t frame;                     // Submission count of the swap chain the frame came from
+        int64_t presentedNs;                // steady_clock time of the present
+        uint32_t crtcId;
+        uint32_t damageCount;               // 0 means the whole frame changed
+        damageRect damage[maxDamageRects];
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Capture ring counters must be lock free to be shared between processes");
+
+    class sink {
+    public:
+        /**
+         * @brief Creates a sink for the frames of one display.
+         *
+         * @param target How frames are written
+         * @param path Name of the shared memory object for SHM, output directory for PPM and RAW. The CRTC id is appended
+         *             to the name, or prefixed to the file names, so several displays don't overwrite each other.
+         * @param crtcId CRTC of the display
+         * @param slotCount Frames kept in the shared memory ring
+         */
+        sink(mode target, const std::string& path, uint32_t crtcId, uint32_t slotCount);
+        ~sink();
+
+        sink(const sink&) = delete;
+        sink& operator=(const sink&) = delete;
+
+        /**
+         * @brief Writes a presented frame.
+         *
+         * @param pixels XRGB8888 rows of the frame
+         * @param damage Changed pixel rectangles since the previous frame, empty means everything changed
+         * @return false if the frame couldn't be written
+         */
+        bool write(const void* pixels, uint32_t width, uint32_t height, uint32_t stride, uint64_t frame,
+                   std::chrono::steady_clock::time_point presented, const std::vector<types::rectangle>& damage);
+
+        // For SHM counted since the ring was last laid out
+        uint64_t getWrittenFrames() const { return sequence; }
+
+    private:
+        mode target;
+        std::string path;
+        uint32_t crtcId;
+        uint32_t slotCount;
+        uint64_t sequence = 0;
+
+        // Shared memory ring, mapped on the first frame once its size is known. Keeps its name until the sink is destroyed.
+        std::string shmName;
+        void* ring = nullptr;
+        size_t ringSize = 0;                // Of the mapping, which may be larger than the current layout needs
+        uint64_t ringGeneration = 0;
+        uint32_t ringWidth = 0;
+        uint32_t ringHeight = 0;
+
+        std::ofstream index;    // Sequence, frame, present time and damage of every file written
+
+        bool openRing(uint32_t width, uint32_t height);
+        void closeRing();
+
+        bool writeRing(const void* pixels, uint32_t width, uint32_t height, uint32_t stride, uint64_t frame,
+                       std::chrono::steady_clock::time_point presented, const std::vector<types::rectangle>& damage);
+        bool writeFile(const void* pixels, uint32_t width, uint32_t height, uint32_t stride, uint64_t frame,
+                       std::chrono::steady_clock::time_point presented, const std::vector<types::rectangle>& damage);
+    };
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include "config.h"
 #include "logger.h"
 #include "window.h"
+#include "renderer.h"
 
 #include <fstream>
 #include <sstream>
@@ -197,98 +198,120 @@ namespace config {
      * Logs information or errors for each action performed.
      */
     void Action::execute() const {
-        char packetBuffer[packet::size];
-        packet::base* basePacket = (packet::base*)packetBuffer;
-        
-        bool closeConnectionAfterwards = false;
-
-        window::handle* current = window::manager::getFocusedHandle();
-
-        if (!current)   // No valid handle found
-            return;
         // Focus switching
-        if (hasFlag(flags, ActionBits::SWITCH_FOCUS_NEXT)) {
-            window::manager::setFocusOnNextAvailableHandle();
-        } else if (hasFlag(flags, ActionBits::SWITCH_FOCUS_PREV)) {
+        if (hasFlag(flags, ActionBits::SWITCH_FOCUS_NEXT) || hasFlag(flags, ActionBits::SWITCH_FOCUS_PREV)) {
             window::manager::setFocusOnNextAvailableHandle();
+            renderer::wake();
+            return;
         }
 
-        // Closing
-        else if (hasFlag(flags, ActionBits::CLOSE_WINDOW)) {
-            if (!current->connection.isClosed()) {
-                LOG_INFO() << "Closing window: " << current->name << std::endl;
-                new(packetBuffer) packet::notify::base(packet::notify::type::CLOSED);
-                closeConnectionAfterwards = true;
-                current->set(window::stain::type::closed, true);
-            }
+        // Custom callbacks are arbitrary code, which may well want the handle lock itself
+        if (hasFlag(flags, ActionBits::CUSTOM)) {
+            if (callback) { callback(); }
+            else { LOG_ERROR() << "Custom action without callback: " << customCommand << std::endl; }
+            renderer::wake();
+            return;
         }
 
-        // Zooms
-        else if (hasFlag(flags, ActionBits::TOGGLE_ZOOM)) {
-            current->zoom = (current->zoom == 1.0f) ? 1.5f : 1.0f;
-            LOG_INFO() << "Toggled zoom for window: " << current->name << " (zoom: " << current->zoom << ")" << std::endl;
-        } else if (hasFlag(flags, ActionBits::ZOOM_IN)) {
-            current->zoom = std::min(current->zoom + 0.1f, 3.0f);
-            LOG_INFO() << "Increased zoom for window: " << current->name << " (zoom: " << current->zoom << ")" << std::endl;
-        } else if (hasFlag(flags, ActionBits::ZOOM_OUT)) {
-            current->zoom = std::max(current->zoom - 0.1f, 0.5f);
-            LOG_INFO() << "Decreased zoom for window: " << current->name << " (zoom: " << current->zoom << ")" << std::endl;
+        // A focus left behind by a removed window moves on to a live one first
+        bool focusValid = false;
+        window::manager::handles.read([&focusValid](const window::handleStore& self) {
+            focusValid = self.get(window::manager::getFocusedHandleId()) != nullptr;
+        });
+        if (!focusValid) {
+            window::manager::setFocusOnNextAvailableHandle();
         }
 
-        // Movement and fullscreen
-        else if (hasFlag(flags, ActionBits::FULLSCREEN)) {
-            if (current->preset != window::position::FULLSCREEN) {
-                current->previousPreset = current->preset;
-                current->preset = window::position::FULLSCREEN;
-                LOG_INFO() << "Moved window to fullscreen: " << current->name << std::endl;
-                types::rectangle newrect = window::positionToPixelCoordinates(window::position::FULLSCREEN, current->displayId);
-                new(packetBuffer) packet::resize::base(types::cellCoordinates(newrect.size));
-                current->set(window::stain::type::resize, true);
+        // Everything touching the focused handle happens under the handle lock, so cleanupDeadHandles can't free it meanwhile
+        window::manager::handles([this](window::handleStore& self) {
+            char packetBuffer[packet::size];
+            packet::base* basePacket = (packet::base*)packetBuffer;
+            
+            bool closeConnectionAfterwards = false;
+
+            window::handle* current = self.get(window::manager::getFocusedHandleId());
+
+            if (!current)   // No valid handle found
+                return;
+
+            // Closing
+            if (hasFlag(flags, ActionBits::CLOSE_WINDOW)) {
+                if (!current->connection.isClosed()) {
+                    LOG_INFO() << "Closing window: " << current->name << std::endl;
+                    new(packetBuffer) packet::notify::base(packet::notify::type::CLOSED);
+                    closeConnectionAfterwards = true;
+                    current->set(window::stain::type::closed, true);
+                }
+            }
+
+            // Zooms
+            else if (hasFlag(flags, ActionBits::TOGGLE_ZOOM)) {
+                current->zoom = (current->zoom == 1.0f) ? 1.5f : 1.0f;
+                LOG_INFO() << "Toggled zoom for window: " << current->name << " (zoom: " << current->zoom << ")" << std::endl;
+            } else if (hasFlag(flags, ActionBits::ZOOM_IN)) {
+                current->zoom = std::min(current->zoom + 0.1f, 3.0f);
+                LOG_INFO() << "Increased zoom for window: " << current->name << " (zoom: " << current->zoom << ")" << std::endl;
+            } else if (hasFlag(flags, ActionBits::ZOOM_OUT)) {
+                current->zoom = std::max(current->zoom - 0.1f, 0.5f);
+                LOG_INFO() << "Decreased zoom for window: " << current->name << " (zoom: " << current->zoom << ")" << std::endl;
             }
-        } else if (hasFlag(flags, ActionBits::MOVE)) {
-            // Resolve direction(s)
-            bool up = hasFlag(flags, ActionBits::DIR_UP);
-            bool down = hasFlag(flags, ActionBits::DIR_DOWN);
-            bool left = hasFlag(flags, ActionBits::DIR_LEFT);
-            bool right = hasFlag(flags, ActionBits::DIR_RIGHT);
 
-            window::position target = current->preset;
-            bool found = true;
-            if (up && left) target = window::position::TOP_LEFT;
-            else if (up && right) target = window::position::TOP_RIGHT;
-            else if (down && left) target = window::position::BOTTOM_LEFT;
-            else if (down && right) target = window::position::BOTTOM_RIGHT;
-            else if (up) target = window::position::TOP;
-            else if (down) target = window::position::BOTTOM;
-            else if (left) target = window::position::LEFT;
-            else if (right) target = window::position::RIGHT;
-            else found = false;
+            // Movement and fullscreen
+            else if (hasFlag(flags, ActionBits::FULLSCREEN)) {
+                if (current->preset != window::position::FULLSCREEN) {
+                    current->previousPreset = current->preset;
+                    current->setPreset(window::position::FULLSCREEN);
+                    LOG_INFO() << "Moved window to fullscreen: " << current->name << std::endl;
+                    types::rectangle newrect = window::positionToPixelCoordinates(window::position::FULLSCREEN, current->displayId);
+                    new(packetBuffer) packet::resize::base(types::cellCoordinates(newrect.size));
+                    current->set(window::stain::type::resize, true);
+                }
+            } else if (hasFlag(flags, ActionBits::MOVE)) {
+                // Resolve direction(s)
+                bool up = hasFlag(flags, ActionBits::DIR_UP);
+                bool down = hasFlag(flags, ActionBits::DIR_DOWN);
+                bool left = hasFlag(flags, ActionBits::DIR_LEFT);
+                bool right = hasFlag(flags, ActionBits::DIR_RIGHT);
+
+                window::position target = current->preset;
+                bool found = true;
+                if (up && left) target = window::position::TOP_LEFT;
+                else if (up && right) target = window::position::TOP_RIGHT;
+                else if (down && left) target = window::position::BOTTOM_LEFT;
+                else if (down && right) target = window::position::BOTTOM_RIGHT;
+                else if (up) target = window::position::TOP;
+                else if (down) target = window::position::BOTTOM;
+                else if (left) target = window::position::LEFT;
+                else if (right) target = window::position::RIGHT;
+                else found = false;
 
-            if (found && current->preset != target) {
-                current->previousPreset = current->preset;
-                current->preset = target;
-                LOG_INFO() << "Moved window: " << current->name << std::endl;
-                types::rectangle newrect = window::positionToPixelCoordinates(target, current->displayId);
-                new(packetBuffer) packet::resize::base(types::cellCoordinates(newrect.size));
-                current->set(window::stain::type::resize, true);
+                if (found && current->preset != target) {
+                    current->previousPreset = current->preset;
+                    current->setPreset(target);
+                    LOG_INFO() << "Moved window: " << current->name << std::endl;
+                    types::rectangle newrect = window::positionToPixelCoordinates(target, current->displayId);
+                    new(packetBuffer) packet::resize::base(types::cellCoordinates(newrect.size));
+                    current->set(window::stain::type::resize, true);
+                }
+            } else {
+                LOG_ERROR() << "Unknown action flags executed: " << static_cast<uint32_t>(flags) << std::endl;
             }
-        } else if (hasFlag(flags, ActionBits::CUSTOM)) {
-            if (callback) { callback(); }
-            else { LOG_ERROR() << "Custom action without callback: " << customCommand << std::endl; }
-        } else {
-            LOG_ERROR() << "Unknown action flags executed: " << static_cast<uint32_t>(flags) << std::endl;
-        }
 
-        if (basePacket->packetType == packet::type::UNKNOWN)
-            return; // no valid packets to send
+            if (basePacket->packetType == packet::type::UNKNOWN)
+                return; // no valid packets to send
 
-        if (!current->connection.Send(packetBuffer, packet::size)) {
-            LOG_ERROR() << "Failed to send action packet to GGUI client" << std::endl;
-        }
+            if (!current->connection.SendFrame(basePacket->packetType, packetBuffer, packet::size)) {
+                LOG_ERROR() << "Failed to send action packet to GGUI client" << std::endl;
+            }
 
-        if (closeConnectionAfterwards) {
-            current->close();
-        }
+            // Nobody else holds the lock, so the descriptor can be released right away
+            if (closeConnectionAfterwards) {
+                current->close();
+            }
+        });
+
+        // Zoom, stains and layout changes are only picked up on the next frame, so don't let the renderer idle through them
+        renderer::wake();
     }
 
     std::string Action::toString() const {
@@ -421,6 +444,9 @@ namespace config {
         primaryDisplayId = 0;
         wallpaperPath = "";               // No wallpaper by default
         backgroundColorRGB = 0x00000000;  // Black in XRGB8888 format
+        captureMode = "none";
+        capturePath = "";
+        captureRingLength = 8;
     }
 
     // Helper function to parse hex color strings
@@ -538,10 +564,18 @@ namespace config {
     // Global wallpaper image instance
     static BitmapImage wallpaperImage;
 
+    void RenderSettings::loadDefaults() {
+        renderThreads = 0;                // One per core
+        parallelThresholdCells = 8192;    // Roughly a quarter of a 1080p screen at the default font size
+        maxFramesPerSecond = 0;           // Follow the display refresh rate
+        swapChainLength = 3;              // Drawing never waits on a pending flip
+    }
+
     // Configuration implementation
     void Configuration::loadDefaults() {
         keybinds.loadDefaults();
         display.loadDefaults();
+        render.loadDefaults();
         
         input.enableGlobalKeybinds = true;
         input.inputPollRate = 60;
@@ -645,6 +679,8 @@ namespace config {
                 section = "keybinds";
             } else if (line.find("\"display\"") != std::string::npos) {
                 section = "display";
+            } else if (line.find("\"render\"") != std::string::npos) {
+                section = "render";
             } else if (line.find("\"input\"") != std::string::npos) {
                 section = "input";
             }
@@ -693,6 +729,15 @@ namespace config {
                         }
                     } else if (key == "displayAssignmentStrategy" && valueStart != std::string::npos && valueEnd != std::string::npos) {
                         config.display.displayAssignmentStrategy = line.substr(valueStart + 1, valueEnd - valueStart - 1);
+                    } else if (key == "captureMode" && valueStart != std::string::npos && valueEnd != std::string::npos) {
+                        config.display.captureMode = line.substr(valueStart + 1, valueEnd - valueStart - 1);
+                    } else if (key == "capturePath" && valueStart != std::string::npos && valueEnd != std::string::npos) {
+                        config.display.capturePath = line.substr(valueStart + 1, valueEnd - valueStart - 1);
+                    } else if (key == "captureRingLength") {
+                        size_t numStart = line.find_first_of("0123456789", colonPos);
+                        if (numStart != std::string::npos) {
+                            config.display.captureRingLength = std::stoul(line.substr(numStart));
+                        }
                     } else if (key == "primaryDisplayId") {
                         // Parse numeric value
                         size_t numStart = line.find_first_of("0123456789", colonPos);
@@ -701,6 +746,25 @@ namespace config {
                         }
                     }
                 }
+            } else if (colonPos != std::string::npos && section == "render") {
+                // Parse renderer settings, all of them are numeric
+                size_t keyStart = line.find('"');
+                size_t keyEnd = line.find('"', keyStart + 1);
+                size_t numStart = line.find_first_of("0123456789", colonPos);
+                
+                if (keyStart != std::string::npos && keyEnd != std::string::npos && numStart != std::string::npos) {
+                    std::string key = line.substr(keyStart + 1, keyEnd - keyStart - 1);
+                    
+                    if (key == "renderThreads") {
+                        config.render.renderThreads = std::stoi(line.substr(numStart));
+                    } else if (key == "parallelThresholdCells") {
+                        config.render.parallelThresholdCells = std::stoi(line.substr(numStart));
+                    } else if (key == "maxFramesPerSecond") {
+                        config.render.maxFramesPerSecond = std::stoi(line.substr(numStart));
+                    } else if (key == "swapChainLength") {
+                        config.render.swapChainLength = std::stoi(line.substr(numStart));
+                    }
+                }
             }
         }
         
@@ -757,7 +821,16 @@ namespace config {
         file << "    \"displayAssignmentStrategy\": \"" << config.display.displayAssignmentStrategy << "\",\n";
         file << "    \"primaryDisplayId\": " << config.display.primaryDisplayId << ",\n";
         file << "    \"backgroundColor\": \"" << config.display.backgroundColor << "\",\n";
-        file << "    \"wallpaperPath\": \"" << config.display.wallpaperPath << "\"\n";
+        file << "    \"wallpaperPath\": \"" << config.display.wallpaperPath << "\",\n";
+        file << "    \"captureMode\": \"" << config.display.captureMode << "\",\n";
+        file << "    \"capturePath\": \"" << config.display.capturePath << "\",\n";
+        file << "    \"captureRingLength\": " << config.display.captureRingLength << "\n";
+        file << "  },\n";
+        file << "  \"render\": {\n";
+        file << "    \"renderThreads\": " << config.render.renderThreads << ",\n";
+        file << "    \"parallelThresholdCells\": " << config.render.parallelThresholdCells << ",\n";
+        file << "    \"maxFramesPerSecond\": " << config.render.maxFramesPerSecond << ",\n";
+        file << "    \"swapChainLength\": " << config.render.swapChainLength << "\n";
         file << "  },\n";
         file << "  \"input\": {\n";
         file << "    \"enableGlobalKeybinds\": " << (config.input.enableGlobalKeybinds ? "true" : "false") << ",\n";
@@ -817,6 +890,12 @@ namespace config {
         file << "    \"displayAssignmentStrategy\": \"" << defaultConfig.display.displayAssignmentStrategy << "\",\n";
         file << "    \"primaryDisplayId\": " << defaultConfig.display.primaryDisplayId << "\n";
         file << "  },\n";
+        file << "  \"render\": {\n";
+        file << "    \"renderThreads\": " << defaultConfig.render.renderThreads << ",\n";
+        file << "    \"parallelThresholdCells\": " << defaultConfig.render.parallelThresholdCells << ",\n";
+        file << "    \"maxFramesPerSecond\": " << defaultConfig.render.maxFramesPerSecond << ",\n";
+        file << "    \"swapChainLength\": " << defaultConfig.render.swapChainLength << "\n";
+        file << "  },\n";
         file << "  \"input\": {\n";
         file << "    \"enableGlobalKeybinds\": " << (defaultConfig.input.enableGlobalKeybinds ? "true" : "false") << ",\n";
         file << "    \"inputPollRate\": " << defaultConfig.input.inputPollRate << "\n";
@@ -903,14 +982,14 @@ namespace config {
     return Action(ActionBits::NONE);
     }
 
-    bool ConfigurationManager::processKeyInput(const KeyCombination& key) {
+    bool ConfigurationManager::resolveKeyInput(const KeyCombination& key, Action& action) const {
         if (!config.input.enableGlobalKeybinds) {
             return false;
         }
         
         auto it = activeKeybinds.find(key);
         if (it != activeKeybinds.end()) {
-            it->second.execute();
+            action = it->second;
             return true; // Key was handled
         }
         
@@ -968,9 +1047,15 @@ namespace config {
         
         bool processKeyInput(const KeyCombination& key) {
             bool result = false;
-            configManager([&result, &key](ConfigurationManager& manager) {
-                result = manager.processKeyInput(key);
+            Action action(ActionBits::NONE);
+            configManager([&result, &key, &action](ConfigurationManager& manager) {
+                result = manager.resolveKeyInput(key, action);
             });
+
+            // Run without the configuration lock, actions take the handle lock and the renderer reads the configuration while holding that
+            if (result) {
+                action.execute();
+            }
             return result;
         }
         
@@ -1048,6 +1133,14 @@ namespace config {
             return result;
         }
         
+        RenderSettings getRenderSettings() {
+            RenderSettings result;
+            configManager([&result](ConfigurationManager& manager) {
+                result = manager.getConfiguration().render;
+            });
+            return result;
+        }
+        
         std::string getWallpaperPath() {
             std::string result;
             configManager([&result](ConfigurationManager& manager) {
@@ -149,6 +149,20 @@ namespace config {
         std::string backgroundColor;      // Hex color string (e.g., "#000000" for black)
         std::string wallpaperPath;       // Path to wallpaper image file (bitmap format)
         uint32_t backgroundColorRGB;     // Cached RGB value for fast access
+
+        // Frame capture in headless mode
+        std::string captureMode;         // "none", "shm" for a shared memory ring, "ppm" or "raw" for a file per frame
+        std::string capturePath;         // Shared memory object name or output directory, empty for the default
+        uint32_t captureRingLength;      // Frames kept in the shared memory ring
+        
+        void loadDefaults();
+    };
+
+    struct RenderSettings {
+        int renderThreads;              // Threads rendering cell bands, 0 uses one per core and 1 keeps rendering on the renderer thread only
+        int parallelThresholdCells;     // Windows with fewer cells than this are always rendered single threaded
+        int maxFramesPerSecond;         // Upper bound on presented frames per second, 0 follows the refresh rate of the primary display
+        int swapChainLength;            // Framebuffers per display, 2 for double and 3 for triple buffering
         
         void loadDefaults();
     };
@@ -164,6 +178,7 @@ namespace config {
     struct Configuration {
         KeyBindSettings keybinds;
         DisplaySettings display;
+        RenderSettings render;
         InputSettings input;
         
         // Configuration metadata
@@ -216,8 +231,8 @@ namespace config {
         Configuration& getConfiguration() { return config; }
         const Configuration& getConfiguration() const { return config; }
         
-        // Input processing
-        bool processKeyInput(const KeyCombination& key);
+        // Input processing, finds the action bound to a key if global keybinds are enabled
+        bool resolveKeyInput(const KeyCombination& key, Action& action) const;
         
         // Validation
         bool validateConfiguration() const;
@@ -256,6 +271,7 @@ namespace config {
         
         // Configuration accessors
         uint32_t getBackgroundColor();
+        RenderSettings getRenderSettings();
         std::string getWallpaperPath();
         bool loadWallpaper(const std::string& wallpaperPath);
         bool getWallpaperPixel(int x, int y, uint32_t& pixel);
@@ -1,4 +1,5 @@
 #include "display.h"
+#include "capture.h"
 #include "logger.h"
 #include <iostream>
 #include <algorithm>
@@ -327,6 +328,268 @@ namespace display {
         };
     }
 
+    //===============================================================================
+    // Swap Chain Implementation
+    //===============================================================================
+
+    // Frames of damage kept for bringing buffers up to date, buffers further behind are copied whole
+    constexpr size_t maxDamageHistory = 8;
+
+    // A few seconds worth of frames at common refresh rates
+    constexpr size_t maxPresentTimings = 512;
+
+    swapChain::swapChain(uint32_t CrtcId, uint32_t ConnectorId, std::vector<std::shared_ptr<frameBuffer>> Buffers)
+        : crtcId(CrtcId), connectorId(ConnectorId), buffers(std::move(Buffers)),
+          states(buffers.size(), state::FREE), contentFrames(buffers.size(), 0),
+          submitTimes(buffers.size()), targetSequences(buffers.size(), 0) {}
+
+    int swapChain::newest() const {
+        int result = -1;
+        for (size_t i = 0; i < buffers.size(); i++) {
+            if (contentFrames[i] != 0 && (result < 0 || contentFrames[i] > contentFrames[result])) {
+                result = static_cast<int>(i);
+            }
+        }
+        return result;
+    }
+
+    void swapChain::copyForward(int target, int source) {
+        frameBuffer& to = *buffers[target];
+        const frameBuffer& from = *buffers[source];
+
+        uint8_t* destination = static_cast<uint8_t*>(to.getBuffer());
+        const uint8_t* origin = static_cast<const uint8_t*>(from.getBuffer());
+        if (!destination || !origin) {
+            return;
+        }
+
+        // Only the frames the target missed need to be copied, as long as all of them are still known
+        uint64_t missedFrom = contentFrames[target] + 1;
+        bool partial = contentFrames[target] != 0 && !history.empty() && history.front().frame <= missedFrom && to.getPitch() == from.getPitch();
+
+        if (partial) {
+            for (const frameDamage& frame : history) {
+                if (frame.frame >= missedFrom && frame.rects.empty()) {
+                    partial = false;
+                    break;
+                }
+            }
+        }
+
+        if (!partial) {
+            memcpy(destination, origin, std::min(to.getSize(), from.getSize()));
+            contentFrames[target] = contentFrames[source];
+            return;
+        }
+
+        const int bytesPerPixel = 4;
+        const int width = static_cast<int>(std::min(to.getWidth(), from.getWidth()));
+        const int height = static_cast<int>(std::min(to.getHeight(), from.getHeight()));
+        const size_t pitch = to.getPitch();
+
+        for (const frameDamage& frame : history) {
+            if (frame.frame < missedFrom || frame.frame > contentFrames[source]) {
+                continue;
+            }
+
+            for (const types::rectangle& rect : frame.rects) {
+                int startX = std::max(0, rect.position.x);
+                int startY = std::max(0, rect.position.y);
+                int endX = std::min(width, rect.position.x + rect.size.x);
+                int endY = std::min(height, rect.position.y + rect.size.y);
+                if (startX >= endX || startY >= endY) {
+                    continue;
+                }
+
+                for (int y = startY; y < endY; y++) {
+                    size_t offset = y * pitch + static_cast<size_t>(startX) * bytesPerPixel;
+                    memcpy(destination + offset, origin + offset, static_cast<size_t>(endX - startX) * bytesPerPixel);
+                }
+            }
+        }
+
+        contentFrames[target] = contentFrames[source];
+    }
+
+    std::shared_ptr<frameBuffer> swapChain::acquire() {
+        if (drawing >= 0) {
+            return buffers[drawing];    // Nothing was submitted since the last acquire
+        }
+
+        // Prefer the free buffer with the newest content, it has the least to catch up on
+        int candidate = -1;
+        for (size_t i = 0; i < buffers.size(); i++) {
+            if (states[i] == state::FREE && (candidate < 0 || contentFrames[i] > contentFrames[candidate])) {
+                candidate = static_cast<int>(i);
+            }
+        }
+
+        if (candidate < 0) {
+            return nullptr;
+        }
+
+        int source = newest();
+        if (source >= 0 && source != candidate && contentFrames[source] > contentFrames[candidate]) {
+            copyForward(candidate, source);
+        }
+
+        states[candidate] = state::DRAWING;
+        drawing = candidate;
+        return buffers[drawing];
+    }
+
+    void swapChain::submit(const std::vector<types::rectangle>& damage) {
+        if (drawing < 0) {
+            return;
+        }
+
+        contentFrames[drawing] = ++submittedFrames;
+        submitTimes[drawing] = std::chrono::steady_clock::now();
+
+        // The frame is due on the next vblank, or the one after if the previous frame is still waiting for its flip
+        targetSequences[drawing] = 0;
+        if (lastSequence != 0 && refreshPeriod.count() > 0) {
+            auto vblanksAhead = (submitTimes[drawing] - lastVblank) / refreshPeriod + 1;
+            targetSequences[drawing] = lastSequence + static_cast<uint32_t>(std::max<decltype(vblanksAhead)>(1, vblanksAhead)) + (queued >= 0 ? 1 : 0);
+        }
+
+        history.push_back({submittedFrames, damage});
+        if (history.size() > maxDamageHistory) {
+            history.erase(history.begin());
+        }
+
+        // Only the newest submitted frame is worth showing, an older one still waiting for its flip is dropped
+        if (ready >= 0) {
+            states[ready] = state::FREE;
+        }
+
+        states[drawing] = state::READY;
+        ready = drawing;
+        drawing = -1;
+    }
+
+    bool swapChain::flipDamage(std::vector<types::rectangle>& rects) const {
+        rects.clear();
+        if (ready < 0 || scanout < 0 || contentFrames[scanout] == 0) {
+            return false;
+        }
+
+        uint64_t from = contentFrames[scanout] + 1;
+        uint64_t to = contentFrames[ready];
+        if (history.empty() || history.front().frame > from) {
+            return false;
+        }
+
+        for (const frameDamage& frame : history) {
+            if (frame.frame < from || frame.frame > to) {
+                continue;
+            }
+            if (frame.rects.empty()) {
+                return false;
+            }
+            rects.insert(rects.end(), frame.rects.begin(), frame.rects.end());
+        }
+
+        return true;
+    }
+
+    std::shared_ptr<frameBuffer> swapChain::nextFlip() const {
+        if (ready < 0 || queued >= 0) {
+            return nullptr;
+        }
+        return buffers[ready];
+    }
+
+    void swapChain::flipQueued() {
+        if (ready < 0) {
+            return;
+        }
+
+        states[ready] = state::QUEUED;
+        queued = ready;
+        ready = -1;
+        flipRetry = false;
+    }
+
+    void swapChain::flipCompleted(uint32_t sequence, std::chrono::steady_clock::time_point timestamp) {
+        if (queued < 0) {
+            return;
+        }
+
+        // Consecutive vblanks refine the period the mode promises, drivers round the refresh rate
+        if (sequence != 0) {
+            if (lastSequence != 0 && sequence > lastSequence && timestamp > lastVblank) {
+                std::chrono::nanoseconds measured = std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp - lastVblank) / (sequence - lastSequence);
+                refreshPeriod = refreshPeriod.count() > 0 ? (refreshPeriod * 7 + measured) / 8 : measured;
+            }
+
+            lastSequence = sequence;
+            lastVblank = timestamp;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(timingMutex);
+
+            bool missed = sequence != 0 && targetSequences[queued] != 0 && sequence > targetSequences[queued];
+            timings.push_back({contentFrames[queued], sequence, submitTimes[queued], timestamp, missed});
+            if (timings.size() > maxPresentTimings) {
+                timings.pop_front();
+            }
+
+            missedFrames += missed;
+        }
+
+        if (scanout >= 0) {
+            states[scanout] = state::FREE;
+        }
+
+        states[queued] = state::SCANOUT;
+        scanout = queued;
+        queued = -1;
+    }
+
+    bool swapChain::canAcquire() const {
+        if (drawing >= 0) {
+            return true;
+        }
+
+        for (state bufferState : states) {
+            if (bufferState == state::FREE) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point swapChain::nextVblank(std::chrono::steady_clock::time_point now) const {
+        if (lastSequence == 0 || refreshPeriod.count() <= 0) {
+            return now;
+        }
+
+        if (now < lastVblank) {
+            return lastVblank;
+        }
+
+        auto periods = (now - lastVblank) / refreshPeriod + 1;
+        return lastVblank + periods * refreshPeriod;
+    }
+
+    void swapChain::setRefreshRate(uint32_t hz) {
+        if (hz > 0 && refreshPeriod.count() <= 0) {
+            refreshPeriod = std::chrono::nanoseconds(1000000000LL / hz);
+        }
+    }
+
+    std::vector<presentTiming> swapChain::getPresentTimings() const {
+        std::lock_guard<std::mutex> lock(timingMutex);
+        return std::vector<presentTiming>(timings.begin(), timings.end());
+    }
+
+    uint64_t swapChain::getMissedFrames() const {
+        std::lock_guard<std::mutex> lock(timingMutex);
+        return missedFrames;
+    }
+
     //===============================================================================
     // Plane Implementation
     //===============================================================================
@@ -759,6 +1022,15 @@ namespace display {
     // Device Implementation
     //===============================================================================
 
+    // Page flips carry the id of their CRTC as user data, so their events can be routed on drivers which report 0 for it
+    static void* crtcUserData(uint32_t crtcId) {
+        return reinterpret_cast<void*>(static_cast<uintptr_t>(crtcId));
+    }
+
+    static uint32_t crtcFromUserData(void* userData) {
+        return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(userData));
+    }
+
     device::device(const std::string& DevicePath)
         : devicePath(DevicePath), deviceFd(-1), initialized(false),
         atomicSupported(false), atomicReq(nullptr) {}
@@ -770,7 +1042,7 @@ namespace display {
     device::device(device&& other) noexcept
         : devicePath(std::move(other.devicePath)), deviceFd(other.deviceFd),
         initialized(other.initialized), atomicSupported(other.atomicSupported),
-        connectors(std::move(other.connectors)), crtcs(std::move(other.crtcs)),
+        monotonicTimestamps(other.monotonicTimestamps), crtcInVblankEvent(other.crtcInVblankEvent), connectors(std::move(other.connectors)), crtcs(std::move(other.crtcs)),
         encoders(std::move(other.encoders)), planes(std::move(other.planes)),
         framebuffers(std::move(other.framebuffers)),
         pageFlipHandler(std::move(other.pageFlipHandler)),
@@ -790,6 +1062,8 @@ namespace display {
             deviceFd = other.deviceFd;
             initialized = other.initialized;
             atomicSupported = other.atomicSupported;
+            monotonicTimestamps = other.monotonicTimestamps;
+            crtcInVblankEvent = other.crtcInVblankEvent;
             connectors = std::move(other.connectors);
             crtcs = std::move(other.crtcs);
             encoders = std::move(other.encoders);
@@ -843,6 +1117,19 @@ namespace display {
         if (atomicSupported) {
             drmSetClientCap(deviceFd, DRM_CLIENT_CAP_ATOMIC, 1);
         }
+
+        // Vblank timestamps can only be compared against steady_clock when both are CLOCK_MONOTONIC
+        uint64_t capMonotonic = 0;
+        monotonicTimestamps = drmGetCap(deviceFd, DRM_CAP_TIMESTAMP_MONOTONIC, &capMonotonic) == 0 && capMonotonic == 1;
+
+        // Older drivers leave the CRTC of page flip events at 0, flips are then told apart by their user data
+        [[maybe_unused]] uint64_t capCrtcInEvent = 0;
+    #ifdef DRM_CAP_CRTC_IN_VBLANK_EVENT
+        crtcInVblankEvent = drmGetCap(deviceFd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &capCrtcInEvent) == 0 && capCrtcInEvent == 1;
+    #endif
+        if (!crtcInVblankEvent) {
+            LOG_INFO() << "Page flip events of " << devicePath << " don't name their CRTC, using the flip user data instead" << std::endl;
+        }
         
         if (!discoverResources()) {
             LOG_ERROR() << "Failed to discover DRM resources" << std::endl;
@@ -865,6 +1152,7 @@ namespace display {
         encoders.clear();
         crtcs.clear();
         connectors.clear();
+        propertyIds.clear();
         
         closeDevice();
         initialized = false;
@@ -881,6 +1169,7 @@ namespace display {
         crtcs.clear();
         encoders.clear();
         planes.clear();
+        propertyIds.clear();
         
         // Reload resources
         discoverResources();
@@ -912,11 +1201,13 @@ namespace display {
         return (it != crtcs.end()) ? *it : nullptr;
     }
 
-    std::shared_ptr<crtc> device::getFreeCrtc() const {
-        // Find the first available CRTC that's not currently in use
+    std::shared_ptr<crtc> device::getFreeCrtc(uint32_t connectorId) const {
+        // Find the first CRTC no other active display is using
         for (const auto& crtc : crtcs) {
-            // For now, just return the first CRTC
-            // In a more sophisticated implementation, we would check if the CRTC is currently active
+            if (isCrtcClaimed(crtc->getId(), connectorId)) {
+                continue;
+            }
+
             LOG_INFO() << "Using CRTC ID: " << crtc->getId() << std::endl;
             return crtc;
         }
@@ -925,6 +1216,20 @@ namespace display {
         return nullptr;
     }
 
+    bool device::isCrtcClaimed(uint32_t crtcId, uint32_t connectorId) const {
+        for (const auto& [displayId, display] : manager::activeDisplays) {
+            if (displayId == connectorId) {
+                continue;
+            }
+
+            std::shared_ptr<crtc> used = manager::findCrtc(display);
+            if (used && used->getId() == crtcId) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     std::shared_ptr<encoder> device::getEncoder(uint32_t id) const {
         auto it = std::find_if(encoders.begin(), encoders.end(),
             [id](const std::shared_ptr<encoder>& enc) {
@@ -1031,14 +1336,30 @@ namespace display {
             return false;
         }
         
-        // Find a CRTC for this encoder
+        // Every active display needs a CRTC of its own, one driving another connector would be taken over by this mode set
+        auto claimedByOther = [this, &connector](uint32_t crtcId) {
+            return isCrtcClaimed(crtcId, connector->getId());
+        };
+
+        // Find a CRTC for this encoder, preferring the one it is already bound to
         std::shared_ptr<crtc> crtcObj = nullptr;
-        if (enc->getCrtcId() != 0) {
+        if (enc->getCrtcId() != 0 && !claimedByOther(enc->getCrtcId())) {
             crtcObj = getCrtc(enc->getCrtcId());
         }
         
         if (!crtcObj) {
-            crtcObj = getFreeCrtc();
+            for (uint32_t crtcId : enc->getPossibleCrtcs()) {
+                if (!claimedByOther(crtcId)) {
+                    crtcObj = getCrtc(crtcId);
+                    if (crtcObj) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (!crtcObj) {
+            crtcObj = getFreeCrtc(connector->getId());
         }
         
         if (!crtcObj) {
@@ -1086,10 +1407,13 @@ namespace display {
         crtcObj->setMode(mode);
         crtcObj->setFramebuffer(fb);
         enc->setCrtc(crtcObj->getId());
+        connector->setEncoder(enc->getId());
         
         LOG_INFO() << "Mode set successfully: " << mode.getWidth() << "x" << mode.getHeight() << 
                      "@" << mode.getRefreshRate() << "Hz on connector " << connector->getName() << std::endl;
         
+        manager::configurationGeneration++;
+
         drmModeFreeConnector(drmConn);
         return true;
     }
@@ -1112,6 +1436,43 @@ namespace display {
         return atomicReq != nullptr;
     }
 
+    uint32_t device::getPropertyId(uint32_t objectId, const std::string& property) {
+        /**
+         * @brief Look up the id of a property by its name
+         * 
+         * Every property of an object is queried from the kernel the first time any of them is
+         * looked up, from then on this is a map lookup.
+         * 
+         * @param objectId The DRM object ID (connector, CRTC, or plane)
+         * @param property The property name
+         * @return The property ID, or 0 if the object has no such property
+         */
+        auto object = propertyIds.find(objectId);
+        if (object == propertyIds.end()) {
+            std::map<std::string, uint32_t> ids;
+
+            drmModeObjectProperties* props = deviceFd >= 0 ? drmModeObjectGetProperties(deviceFd, objectId, DRM_MODE_OBJECT_ANY) : nullptr;
+            if (props) {
+                for (uint32_t i = 0; i < props->count_props; i++) {
+                    drmModePropertyPtr prop = drmModeGetProperty(deviceFd, props->props[i]);
+                    if (prop) {
+                        ids[prop->name] = prop->prop_id;
+                        drmModeFreeProperty(prop);
+                    }
+                }
+                drmModeFreeObjectProperties(props);
+            }
+            else {
+                LOG_ERROR() << "Failed to get properties of object " << objectId << ": " << strerror(errno) << std::endl;
+            }
+
+            object = propertyIds.emplace(objectId, std::move(ids)).first;
+        }
+
+        auto it = object->second.find(property);
+        return it != object->second.end() ? it->second : 0;
+    }
+
     bool device::addAtomicProperty(uint32_t objectId, const std::string& property, uint64_t value) {
         /**
          * @brief Add a property to the current atomic commit request
@@ -1129,32 +1490,92 @@ namespace display {
             return false;
         }
         
-        // This is a simplified implementation - in a real implementation,
-        // we would need to look up the property ID from the property name
-        // and add it to the atomic request using drmModeAtomicAddProperty
-        
-        LOG_INFO() << "Adding atomic property: object=" << objectId << ", property=" << property << ", value=" << value << std::endl;
+        uint32_t propertyId = getPropertyId(objectId, property);
+        if (propertyId == 0) {
+            LOG_ERROR() << "Object " << objectId << " has no property " << property << std::endl;
+            return false;
+        }
+
+        if (drmModeAtomicAddProperty(static_cast<drmModeAtomicReqPtr>(atomicReq), objectId, propertyId, value) < 0) {
+            LOG_ERROR() << "Failed to add atomic property " << property << " of object " << objectId << ": " << strerror(errno) << std::endl;
+            return false;
+        }
         
-        // For now, just return true to indicate we would add the property
         return true;
     }
 
-    bool device::commitAtomic(bool testOnly) {
+    bool device::commitAtomic(bool testOnly, bool nonBlocking, void* userData) {
         if (!atomicReq) {
             return false;
         }
         
         uint32_t flags = testOnly ? DRM_MODE_ATOMIC_TEST_ONLY : 0;
-        int ret = drmModeAtomicCommit(deviceFd, static_cast<drmModeAtomicReqPtr>(atomicReq), flags, nullptr);
+        if (!testOnly && nonBlocking) {
+            flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+        }
+
+        int ret = drmModeAtomicCommit(deviceFd, static_cast<drmModeAtomicReqPtr>(atomicReq), flags, userData);
+        int error = errno;
         
         if (!testOnly) {
             drmModeAtomicFree(static_cast<drmModeAtomicReqPtr>(atomicReq));
             atomicReq = nullptr;
         }
         
+        errno = error;      // Callers tell a busy CRTC apart from a real failure
         return ret == 0;
     }
 
+    std::shared_ptr<plane> device::getPrimaryPlane(std::shared_ptr<crtc> crtc) {
+        /**
+         * @brief Find the primary plane scanning out for a CRTC
+         * 
+         * @param crtc The CRTC
+         * @return The primary plane attached to the CRTC, or else one which can be, nullptr if there is none
+         */
+        if (!crtc) {
+            return nullptr;
+        }
+
+        if (deviceFd < 0) {
+            return crtc->getPrimaryPlane();
+        }
+
+        // Planes name the CRTCs they can drive by their index in the resources
+        int crtcIndex = -1;
+        for (size_t i = 0; i < crtcs.size(); i++) {
+            if (crtcs[i]->getId() == crtc->getId()) {
+                crtcIndex = static_cast<int>(i);
+                break;
+            }
+        }
+
+        std::shared_ptr<plane> candidate = nullptr;
+        for (const auto& planeObj : planes) {
+            if (planeObj->getType() != plane::Type::PRIMARY) {
+                continue;
+            }
+
+            drmModePlane* drmPlane = drmModeGetPlane(deviceFd, planeObj->getId());
+            if (!drmPlane) {
+                continue;
+            }
+
+            bool attached = drmPlane->crtc_id == crtc->getId();
+            bool possible = crtcIndex >= 0 && crtcIndex < 32 && (drmPlane->possible_crtcs & (1u << crtcIndex)) != 0;
+            drmModeFreePlane(drmPlane);
+
+            if (attached) {
+                return planeObj;
+            }
+            if (possible && !candidate) {
+                candidate = planeObj;
+            }
+        }
+
+        return candidate;
+    }
+
     bool device::pageFlip(std::shared_ptr<crtc> crtc, std::shared_ptr<frameBuffer> fb, void* userData) {
         /**
          * @brief Perform a page flip operation
@@ -1175,13 +1596,53 @@ namespace display {
                                  DRM_MODE_PAGE_FLIP_EVENT, userData);
         
         if (ret != 0) {
-            LOG_ERROR() << "Failed to initiate page flip: " << strerror(errno) << std::endl;
+            int error = errno;
+            if (error != EBUSY) {   // A flip still pending isn't worth logging, the caller retries later
+                LOG_ERROR() << "Failed to initiate page flip: " << strerror(error) << std::endl;
+            }
+            errno = error;          // Callers tell a busy CRTC apart from a real failure
             return false;
         }
         
         return true;
     }
 
+    bool device::setCrtcFramebuffer(std::shared_ptr<crtc> crtc, uint32_t connectorId, std::shared_ptr<frameBuffer> fb) {
+        /**
+         * @brief Point a CRTC at another framebuffer right away, keeping its current mode
+         * 
+         * Blocks until the change is made and may tear, only meant for when page flips fail.
+         * 
+         * @param crtc The CRTC to update
+         * @param connectorId The connector the CRTC drives
+         * @param fb The framebuffer to scan out
+         * @return true if the CRTC now scans out the framebuffer, false otherwise
+         */
+        if (!crtc || !fb || deviceFd < 0) {
+            return false;
+        }
+
+        drmModeCrtc* current = drmModeGetCrtc(deviceFd, crtc->getId());
+        if (!current) {
+            LOG_ERROR() << "Failed to get CRTC " << crtc->getId() << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        int ret = -1;
+        if (current->mode_valid) {
+            ret = drmModeSetCrtc(deviceFd, crtc->getId(), fb->getId(), 0, 0, &connectorId, 1, &current->mode);
+        }
+        drmModeFreeCrtc(current);
+
+        if (ret != 0) {
+            LOG_ERROR() << "Failed to set framebuffer " << fb->getId() << " on CRTC " << crtc->getId() << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        crtc->setFramebuffer(fb);
+        return true;
+    }
+
     bool device::handleEvents(int timeoutMs) {
         /**
          * @brief Handle DRM events such as page flip completion
@@ -1222,12 +1683,22 @@ namespace display {
             // Set up event context for page flip handler
             drmEventContext evctx;
             memset(&evctx, 0, sizeof(evctx));
-            evctx.version = DRM_EVENT_CONTEXT_VERSION;
+            evctx.version = 3;  // The first version which reports the CRTC of a page flip
             // This lambda will be called when a page flip completes
-            evctx.page_flip_handler = []([[maybe_unused]] int fd, unsigned int sequence, [[maybe_unused]] unsigned int tv_sec, [[maybe_unused]] unsigned int tv_usec, void* user_data) {
+            evctx.page_flip_handler2 = []([[maybe_unused]] int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id, void* user_data) {
                 // If we have a page flip handler, call it
                 if (manager::Device && manager::Device->pageFlipHandler) {
-                    manager::Device->pageFlipHandler(0, sequence, user_data);
+                    // Without DRM_CAP_CRTC_IN_VBLANK_EVENT the kernel reports 0, the flip carries its CRTC id as user data instead
+                    if (crtc_id == 0 || !manager::Device->crtcInVblankEvent) {
+                        crtc_id = crtcFromUserData(user_data);
+                    }
+
+                    // Without monotonic timestamps the time of receiving the event is the best estimate of the vblank
+                    std::chrono::steady_clock::time_point timestamp = manager::Device->monotonicTimestamps ?
+                        std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(tv_sec) + std::chrono::microseconds(tv_usec))) :
+                        std::chrono::steady_clock::now();
+
+                    manager::Device->pageFlipHandler(crtc_id, sequence, timestamp, user_data);
                 }
             };
             
@@ -1241,7 +1712,7 @@ namespace display {
         return true;
     }
 
-    void device::setPageFlipHandler(std::function<void(uint32_t, uint32_t, void*)> handler) {
+    void device::setPageFlipHandler(std::function<void(uint32_t, uint32_t, std::chrono::steady_clock::time_point, void*)> handler) {
         pageFlipHandler = handler;
     }
 
@@ -1737,17 +2208,24 @@ namespace display {
     namespace manager {
         std::shared_ptr<device> Device;
         std::map<uint32_t, std::shared_ptr<connector>> activeDisplays;
+        std::atomic<uint64_t> configurationGeneration{1};
         std::function<void(std::shared_ptr<connector>, bool)> hotplugHandler;
-        static bool pageFlipPending = false;  // Track if a page flip is currently pending
+        std::map<uint32_t, std::shared_ptr<swapChain>> swapChains;
     }
 
     bool manager::initialize(const std::string& devicePath) {
         Device = std::make_shared<device>(devicePath);
         
-        // Set up page flip completion handler to track pending state
+        // Page flip completions free up the previous front buffer and let the next submitted frame flip
         if (Device) {
-            Device->setPageFlipHandler([]([[maybe_unused]] uint32_t crtc_id, [[maybe_unused]] uint32_t sequence, [[maybe_unused]] void* user_data) {
-                pageFlipPending = false; // Reset pending state when page flip completes
+            Device->setPageFlipHandler([](uint32_t crtc_id, uint32_t sequence, std::chrono::steady_clock::time_point timestamp, [[maybe_unused]] void* user_data) {
+                auto it = swapChains.find(crtc_id);
+                if (it == swapChains.end()) {
+                    return;     // The swap chain was destroyed while its flip was in flight
+                }
+
+                it->second->flipCompleted(sequence, timestamp);
+                flush(*it->second);
             });
         }
         
@@ -1755,11 +2233,13 @@ namespace display {
     }
 
     void manager::cleanup() {
+        swapChains.clear();
         if (Device) {
             Device->cleanup();
             Device.reset();
         }
         activeDisplays.clear();
+        configurationGeneration++;
     }
 
     std::vector<std::shared_ptr<connector>> manager::getAvailableDisplays() {
@@ -1773,6 +2253,7 @@ namespace display {
         
         if (setupDisplay(connector, mode)) {
             activeDisplays[connector->getId()] = connector;
+            configurationGeneration++;
             return true;
         }
         return false;
@@ -1786,6 +2267,7 @@ namespace display {
         auto it = activeDisplays.find(connector->getId());
         if (it != activeDisplays.end()) {
             activeDisplays.erase(it);
+            configurationGeneration++;
             return true;
         }
         return false;
@@ -1825,6 +2307,7 @@ namespace display {
                 success = false;
             } else {
                 activeDisplays[connector->getId()] = connector;
+                configurationGeneration++;
             }
         }
         
@@ -1863,6 +2346,7 @@ namespace display {
                 success = false;
             } else {
                 activeDisplays[connector->getId()] = connector;
+                configurationGeneration++;
                 LOG_INFO() << "Extended display set up for " << connector->getName() << 
                              " at " << displayMode.getWidth() << "x" << displayMode.getHeight() << 
                              "@" << displayMode.getRefreshRate() << "Hz" << std::endl;
@@ -1893,85 +2377,247 @@ namespace display {
         return Device->createFramebuffer(info);
     }
 
-    bool manager::present(std::shared_ptr<connector> connector, std::shared_ptr<frameBuffer> fb) {
+    std::shared_ptr<crtc> manager::findCrtc(std::shared_ptr<connector> connector) {
+        if (!Device || !connector) {
+            return nullptr;
+        }
+
+        if (connector->getEncoderId() != 0) {
+            auto encoder = Device->getEncoder(connector->getEncoderId());
+            if (encoder && encoder->getCrtcId() != 0) {
+                return Device->getCrtc(encoder->getCrtcId());
+            }
+        }
+
+        // Headless resources only have the one CRTC
+        if (Device->getDeviceFd() == -2 && !Device->getCrtcs().empty()) {
+            return Device->getCrtcs().front();
+        }
+
+        return nullptr;
+    }
+
+    std::shared_ptr<swapChain> manager::createSwapChain(std::shared_ptr<connector> connector, uint32_t width, uint32_t height, size_t bufferCount) {
         /**
-         * @brief Present a framebuffer to the specified connector
-         * 
-         * This function displays the contents of the framebuffer on the
-         * specified connector. It can use either page flipping for smooth
-         * updates or direct framebuffer swapping.
+         * @brief Create the framebuffers a connector's CRTC flips between
          * 
-         * @param connector The connector to present to
-         * @param fb The framebuffer to display
-         * @return true if framebuffer was presented successfully, false otherwise
+         * @param connector The connector to present to, must already be enabled
+         * @param width Width of each buffer in pixels
+         * @param height Height of each buffer in pixels
+         * @param bufferCount Number of buffers, clamped to what a swap chain supports
+         * @return The swap chain, or nullptr if the CRTC couldn't be found or a buffer couldn't be created
          */
-        if (!Device || !connector || !fb) {
-            return false;
+        std::shared_ptr<crtc> crtcObj = findCrtc(connector);
+        if (!crtcObj) {
+            LOG_ERROR() << "No CRTC found for connector " << (connector ? connector->getName() : "(null)") << std::endl;
+            return nullptr;
         }
-        
-        // Check if we're in headless mode
-        if (Device->getDeviceFd() == -2) {
-            // In headless mode, we just simulate successful presentation
-            static int frameCount = 0;
-            frameCount++;
-            
-            // if (frameCount % 60 == 0) {  // Log every 60 frames (once per second at 60 FPS)
-            //     LOG_INFO() << "Headless mode: Frame " << frameCount << " rendered (" << 
-            //                  fb->getWidth() << "x" << fb->getHeight() << ")" << std::endl;
-            // }
-            
-            return true;
+
+        bufferCount = std::clamp(bufferCount, swapChain::minBuffers, swapChain::maxBuffers);
+
+        std::vector<std::shared_ptr<frameBuffer>> buffers;
+        for (size_t i = 0; i < bufferCount; i++) {
+            auto fb = createFramebuffer(width, height, DRM_FORMAT_XRGB8888);
+            if (!fb || !fb->map()) {
+                LOG_ERROR() << "Failed to create buffer " << i << " of the swap chain for CRTC " << crtcObj->getId() << std::endl;
+                for (auto& created : buffers) {
+                    Device->destroyFramebuffer(created);
+                }
+                if (fb) {
+                    Device->destroyFramebuffer(fb);
+                }
+                return nullptr;
+            }
+
+            fb->clear(0x00000000);
+            buffers.push_back(fb);
         }
-        
-        // Check if this connector is active
-        auto it = activeDisplays.find(connector->getId());
-        if (it == activeDisplays.end()) {
-            LOG_ERROR() << "Connector " << connector->getName() << " is not active" << std::endl;
+
+        auto chain = std::make_shared<swapChain>(crtcObj->getId(), connector->getId(), std::move(buffers));
+        chain->setRefreshRate(crtcObj->getCurrentMode().getRefreshRate());
+        swapChains[crtcObj->getId()] = chain;
+
+        // Flip through atomic commits if the driver accepts one for this CRTC, which a test-only commit tells without changing anything
+        if (Device->supportsAtomic()) {
+            std::shared_ptr<plane> primary = Device->getPrimaryPlane(crtcObj);
+            if (primary &&
+                Device->beginAtomicCommit() &&
+                Device->addAtomicProperty(primary->getId(), "FB_ID", chain->getBuffers().front()->getId()) &&
+                Device->addAtomicProperty(primary->getId(), "CRTC_ID", crtcObj->getId()) &&
+                Device->commitAtomic(true)) {
+                chain->useAtomic(primary->getId(), Device->getPropertyId(primary->getId(), "FB_DAMAGE_CLIPS") != 0);
+            }
+            else {
+                LOG_INFO() << "Atomic test commit for CRTC " << crtcObj->getId() << " was rejected, using legacy page flips" << std::endl;
+            }
+        }
+
+        LOG_INFO() << "Created swap chain of " << bufferCount << " " << width << "x" << height << " buffers for CRTC " << crtcObj->getId() 
+                   << (chain->getAtomicPlaneId() ? " flipping through atomic commits on plane " + std::to_string(chain->getAtomicPlaneId()) : std::string(" flipping through legacy page flips"))
+                   << (chain->supportsDamageClips() ? " with damage clips" : "") << std::endl;
+        return chain;
+    }
+
+    void manager::destroySwapChain(std::shared_ptr<swapChain> chain) {
+        if (!chain) {
+            return;
+        }
+
+        auto it = swapChains.find(chain->getCrtcId());
+        if (it != swapChains.end() && it->second == chain) {
+            swapChains.erase(it);
+        }
+
+        if (Device) {
+            for (auto& fb : chain->getBuffers()) {
+                Device->destroyFramebuffer(fb);
+            }
+        }
+    }
+
+    // More clips than this cost the driver more than just updating everything
+    constexpr size_t maxDamageClips = 64;
+
+    bool manager::atomicFlip(swapChain& chain, std::shared_ptr<frameBuffer> fb) {
+        uint32_t planeId = chain.getAtomicPlaneId();
+        if (!Device->beginAtomicCommit()) {
             return false;
         }
-        
-        // Find the CRTC associated with this connector
-        std::shared_ptr<crtc> crtcObj = nullptr;
-        if (connector->getEncoderId() != 0) {
-            auto encoder = Device->getEncoder(connector->getEncoderId());
-            if (encoder && encoder->getCrtcId() != 0) {
-                crtcObj = Device->getCrtc(encoder->getCrtcId());
+
+        bool added = Device->addAtomicProperty(planeId, "FB_ID", fb->getId()) &&
+                     Device->addAtomicProperty(planeId, "CRTC_ID", chain.getCrtcId());
+
+        // Tell the driver which parts changed since the front buffer, so it can upload or scan out only those
+        uint32_t damageBlob = 0;
+        std::vector<types::rectangle> damage;
+        if (added && chain.supportsDamageClips() && chain.flipDamage(damage) && !damage.empty() && damage.size() <= maxDamageClips) {
+            std::vector<drm_mode_rect> clips;
+            clips.reserve(damage.size());
+            for (const types::rectangle& rect : damage) {
+                clips.push_back({rect.position.x, rect.position.y, rect.position.x + rect.size.x, rect.position.y + rect.size.y});
+            }
+
+            if (drmModeCreatePropertyBlob(Device->getDeviceFd(), clips.data(), clips.size() * sizeof(drm_mode_rect), &damageBlob) == 0) {
+                added = Device->addAtomicProperty(planeId, "FB_DAMAGE_CLIPS", damageBlob);
+            }
+            else {
+                damageBlob = 0;     // Without clips the whole plane counts as damaged
             }
         }
-        
+
+        bool committed = added && Device->commitAtomic(false, true, crtcUserData(chain.getCrtcId()));
+        int error = errno;
+
+        // The commit holds its own reference to the clips
+        if (damageBlob != 0) {
+            drmModeDestroyPropertyBlob(Device->getDeviceFd(), damageBlob);
+        }
+
+        errno = error;
+        return committed;
+    }
+
+    bool manager::flush(swapChain& chain) {
+        std::shared_ptr<frameBuffer> fb = chain.nextFlip();
+        if (!fb) {
+            return true;    // Nothing new, or the queued flip brings it up once it completes
+        }
+
+        // Headless mode has no vblank to wait for, the flip is done as soon as it's queued
+        if (Device->getDeviceFd() == -2) {
+            if (chain.getCaptureSink()) {
+                std::vector<types::rectangle> damage;
+                if (!chain.flipDamage(damage)) {
+                    damage.clear();     // Unknown, the whole frame counts as changed
+                }
+
+                chain.getCaptureSink()->write(fb->getBuffer(), fb->getWidth(), fb->getHeight(), fb->getPitch(), chain.getReadyFrame(), std::chrono::steady_clock::now(), damage);
+            }
+
+            chain.flipQueued();
+            chain.flipCompleted();
+            return true;
+        }
+
+        std::shared_ptr<crtc> crtcObj = Device->getCrtc(chain.getCrtcId());
         if (!crtcObj) {
-            LOG_ERROR() << "No CRTC found for connector " << connector->getName() << std::endl;
+            LOG_ERROR() << "CRTC " << chain.getCrtcId() << " of the swap chain is gone" << std::endl;
             return false;
         }
-        
-        // For now, just update the CRTC with the new framebuffer
-        // Page flipping might not be working due to the DRM driver or hardware limitations
-        // Let's use a simpler approach of just updating the CRTC framebuffer
-        crtcObj->setFramebuffer(fb);
-        
-        // Try to use page flipping for smooth updates
-        static bool pageFlipSupported = true;
-        if (pageFlipSupported && !pageFlipPending && Device->pageFlip(crtcObj, fb, nullptr)) {
-            pageFlipPending = true;
+
+        bool flipped = chain.getAtomicPlaneId() != 0 ? atomicFlip(chain, fb) : Device->pageFlip(crtcObj, fb, crtcUserData(chain.getCrtcId()));
+        if (flipped) {
+            crtcObj->setFramebuffer(fb);
+            chain.flipQueued();
             return true;
         }
-        
-        // If page flip fails, disable it for future frames to avoid spam
-        if (pageFlipSupported && !pageFlipPending) {
-            pageFlipSupported = false;
-            // LOG_INFO() << "Page flip not supported, using direct framebuffer updates" << std::endl;
+
+        // Something else holds a flip on this CRTC, the frame stays submitted. No flip event of ours is coming to flush it,
+        // so the renderer tries again through retryFlip.
+        if (errno == EBUSY) {
+            chain.setFlipRetry(true);
+            return true;
         }
-        
-        // Since we can't do page flipping, just update the framebuffer reference
-        // The actual display should already be set up with the correct mode
-        // and the framebuffer content is being updated in-place
-        return true;
+
+        if (chain.getAtomicPlaneId() != 0) {
+            LOG_ERROR() << "Atomic flip on CRTC " << chain.getCrtcId() << " failed: " << strerror(errno) << ", falling back to legacy page flips" << std::endl;
+            chain.useAtomic(0, false);
+        }
+
+        // Show the frame anyway, flipping is attempted again for the next one
+        if (Device->setCrtcFramebuffer(crtcObj, chain.getConnectorId(), fb)) {
+            chain.flipQueued();
+            chain.flipCompleted();
+            return true;
+        }
+
+        return false;
+    }
+
+    bool manager::present(std::shared_ptr<swapChain> chain, const std::vector<types::rectangle>& damage) {
+        /**
+         * @brief Present the frame drawn into a swap chain's back buffer
+         * 
+         * The frame is flipped to on the next vblank without waiting for it. If a flip is still
+         * pending, the frame waits for it and replaces any older frame waiting as well.
+         * 
+         * @param chain The swap chain whose acquired buffer holds the frame
+         * @param damage Pixel rectangles changed since the last present, empty means the whole framebuffer
+         * @return true if framebuffer was presented successfully, false otherwise
+         */
+        if (!Device || !chain) {
+            return false;
+        }
+
+        chain->submit(damage);
+        return flush(*chain);
+    }
+
+    bool manager::retryFlip(std::shared_ptr<swapChain> chain) {
+        if (!Device || !chain || !chain->needsFlipRetry()) {
+            return false;
+        }
+
+        chain->setFlipRetry(false);
+        flush(*chain);
+        return chain->needsFlipRetry();
     }
 
     bool manager::processEvents(int timeoutMs) {
         return Device ? Device->handleEvents(timeoutMs) : false;
     }
 
+    bool manager::isHeadless() {
+        return Device && Device->getDeviceFd() == -2;
+    }
+
+    int manager::getEventFd() {
+        if (!Device || Device->getDeviceFd() < 0) {
+            return -1;  // Headless mode has no event source
+        }
+        return Device->getDeviceFd();
+    }
+
     void manager::setHotplugHandler(std::function<void(std::shared_ptr<connector>, bool)> handler) {
         hotplugHandler = handler;
     }
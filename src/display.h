@@ -8,6 +8,14 @@
 #include <map>
 #include <functional>
 #include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+namespace capture {
+    class sink;
+}
 
 // Forward declarations for DRM types
 extern "C" {
@@ -167,6 +175,152 @@ namespace display {
         int dmaBufFd;
     };
 
+    // When a frame of a swap chain reached the screen, kept for latency analysis
+    struct presentTiming {
+        uint64_t frame;                                     // Submission count of the swap chain
+        uint32_t sequence;                                  // Vblank counter of the CRTC it was flipped on, 0 if no vblank was involved
+        std::chrono::steady_clock::time_point submitted;
+        std::chrono::steady_clock::time_point presented;    // Vblank timestamp reported by the kernel
+        bool missed;                                        // Reached the screen on a later vblank than the one it was submitted for
+    };
+
+    /**
+     * @brief Framebuffers of one CRTC which take turns being drawn into and scanned out
+     * 
+     * The renderer draws into a back buffer while the front one is on screen, and the back buffer
+     * becomes the front one on the next vblank. Before a buffer is drawn into again, the regions
+     * damaged since it was last drawn are copied over from the newest buffer, so it always starts out
+     * with exactly what the previous frame showed. Only used from the renderer thread, apart from
+     * the present timings which may be read from anywhere.
+     */
+    class swapChain {
+    public:
+        enum class state {
+            FREE,       // Can be drawn into
+            DRAWING,    // Handed out by acquire, not submitted yet
+            READY,      // Submitted, waiting for its page flip to be queued
+            QUEUED,     // Page flip queued, becomes the front buffer on the next vblank
+            SCANOUT     // Currently on screen
+        };
+
+        constexpr static size_t minBuffers = 2;
+        constexpr static size_t maxBuffers = 3;
+
+        swapChain(uint32_t crtcId, uint32_t connectorId, std::vector<std::shared_ptr<frameBuffer>> buffers);
+
+        uint32_t getCrtcId() const { return crtcId; }
+        uint32_t getConnectorId() const { return connectorId; }
+        size_t size() const { return buffers.size(); }
+
+        /**
+         * @brief Hands out the buffer to draw the next frame into, brought up to date with the newest frame.
+         * 
+         * @return The back buffer, or nullptr if every buffer is either on screen or waiting for a flip
+         */
+        std::shared_ptr<frameBuffer> acquire();
+
+        // Marks the acquired buffer as finished, damage lists the pixel rectangles drawn into it, empty means everything
+        void submit(const std::vector<types::rectangle>& damage);
+
+        // The submitted buffer to flip to next, nullptr if there is none or a flip is already queued
+        std::shared_ptr<frameBuffer> nextFlip() const;
+
+        void flipQueued();      // The buffer from nextFlip has been queued for the next vblank
+
+        /**
+         * @brief The queued buffer is on screen now, the previous front buffer is free again.
+         * 
+         * @param sequence Vblank counter of the CRTC the flip happened on, 0 if it wasn't synchronized to a vblank
+         * @param timestamp When the vblank happened
+         */
+        void flipCompleted(uint32_t sequence, std::chrono::steady_clock::time_point timestamp);
+        void flipCompleted() { flipCompleted(0, std::chrono::steady_clock::now()); }
+
+        bool flipPending() const { return queued >= 0; }
+
+        // A busy CRTC turned the flip of the ready buffer down, nothing but another try flips it
+        void setFlipRetry(bool retry) { flipRetry = retry; }
+        bool needsFlipRetry() const { return flipRetry; }
+        bool canAcquire() const;    // Whether acquire would hand out a buffer
+
+        /**
+         * @brief Predicts the first vblank after 'now' from the timestamps of completed flips.
+         * 
+         * @return The vblank, or 'now' itself while no vblank timing is known
+         */
+        std::chrono::steady_clock::time_point nextVblank(std::chrono::steady_clock::time_point now) const;
+
+        // Seeds the vblank period before any flip measured it
+        void setRefreshRate(uint32_t hz);
+        std::chrono::nanoseconds getRefreshPeriod() const { return refreshPeriod; }
+
+        std::vector<presentTiming> getPresentTimings() const;  // Oldest first, of the latest presented frames
+        uint64_t getMissedFrames() const;
+
+        // Frame held by the buffer nextFlip returns, 0 if there is none
+        uint64_t getReadyFrame() const { return ready >= 0 ? contentFrames[ready] : 0; }
+
+        // Receives every frame flipped to in headless mode
+        void setCaptureSink(std::shared_ptr<capture::sink> sink) { captureSink = std::move(sink); }
+        const std::shared_ptr<capture::sink>& getCaptureSink() const { return captureSink; }
+
+        /**
+         * @brief Collects what differs between the front buffer and the one nextFlip returns.
+         * 
+         * @param rects Receives the changed pixel rectangles
+         * @return false if that isn't known, in which case everything has to be treated as changed
+         */
+        bool flipDamage(std::vector<types::rectangle>& rects) const;
+
+        // Flips through atomic commits on the given primary plane instead of legacy page flips
+        void useAtomic(uint32_t planeId, bool damageClips) { atomicPlaneId = planeId; atomicDamageClips = damageClips; }
+        uint32_t getAtomicPlaneId() const { return atomicPlaneId; }    // 0 when legacy page flips are used
+        bool supportsDamageClips() const { return atomicDamageClips; }
+
+        const std::vector<std::shared_ptr<frameBuffer>>& getBuffers() const { return buffers; }
+
+    private:
+        struct frameDamage {
+            uint64_t frame;
+            std::vector<types::rectangle> rects;    // Empty means the whole buffer
+        };
+
+        uint32_t crtcId;
+        uint32_t connectorId;
+
+        std::vector<std::shared_ptr<frameBuffer>> buffers;
+        std::vector<state> states;
+        std::vector<uint64_t> contentFrames;        // Frame each buffer holds, 0 for never drawn into
+        std::vector<std::chrono::steady_clock::time_point> submitTimes;    // When the frame each buffer holds was submitted
+        std::vector<uint32_t> targetSequences;      // Vblank each buffer was submitted for, 0 if that wasn't predictable
+
+        std::vector<frameDamage> history;           // Damage of the latest frames, oldest first
+        uint64_t submittedFrames = 0;
+
+        uint32_t atomicPlaneId = 0;
+        bool atomicDamageClips = false;
+
+        std::shared_ptr<capture::sink> captureSink;
+
+        uint32_t lastSequence = 0;                              // Of the latest vblank a flip completed on
+        std::chrono::steady_clock::time_point lastVblank{};
+        std::chrono::nanoseconds refreshPeriod{0};
+
+        mutable std::mutex timingMutex;
+        std::deque<presentTiming> timings;
+        uint64_t missedFrames = 0;
+
+        bool flipRetry = false;
+
+        int drawing = -1;   // Indices of the buffers in the respective state, -1 if there is none
+        int ready = -1;
+        int queued = -1;
+        int scanout = -1;
+
+        int newest() const;
+        void copyForward(int target, int source);
+    };
+
     /**
      * @brief Represents a DRM plane (overlay, primary, cursor)
      */
@@ -400,7 +554,8 @@ namespace display {
         // CRTC management
         const std::vector<std::shared_ptr<crtc>>& getCrtcs() const { return crtcs; }
         std::shared_ptr<crtc> getCrtc(uint32_t id) const;
-        std::shared_ptr<crtc> getFreeCrtc() const;
+        std::shared_ptr<crtc> getFreeCrtc(uint32_t connectorId = 0) const;            // Skips CRTCs driving active displays other than connectorId
+        bool isCrtcClaimed(uint32_t crtcId, uint32_t connectorId = 0) const;      // Whether an active display other than connectorId is on it
 
         // Encoder management
         const std::vector<std::shared_ptr<encoder>>& getEncoders() const { return encoders; }
@@ -422,14 +577,19 @@ namespace display {
         // Atomic operations
         bool beginAtomicCommit();
         bool addAtomicProperty(uint32_t objectId, const std::string& property, uint64_t value);
-        bool commitAtomic(bool testOnly = false);
+        bool commitAtomic(bool testOnly = false, bool nonBlocking = false, void* userData = nullptr);   // Non blocking commits report completion as a page flip event carrying userData
+        uint32_t getPropertyId(uint32_t objectId, const std::string& property);   // 0 if the object has no such property
+        std::shared_ptr<plane> getPrimaryPlane(std::shared_ptr<crtc> crtc);
 
         // Page flipping
         bool pageFlip(std::shared_ptr<crtc> crtc, std::shared_ptr<frameBuffer> fb, void* userData = nullptr);
+        bool setCrtcFramebuffer(std::shared_ptr<crtc> crtc, uint32_t connectorId, std::shared_ptr<frameBuffer> fb);  // Blocking fallback for when flips fail
 
         // Event handling
         bool handleEvents(int timeoutMs = 0);
-        void setPageFlipHandler(std::function<void(uint32_t, uint32_t, void*)> handler);
+        // Called with the CRTC, vblank sequence and vblank timestamp of every completed page flip.
+        // Flips have to pass their CRTC id as user data for drivers whose events don't carry it.
+        void setPageFlipHandler(std::function<void(uint32_t, uint32_t, std::chrono::steady_clock::time_point, void*)> handler);
 
         // Utility methods
         int getDeviceFd() const { return deviceFd; }
@@ -441,6 +601,8 @@ namespace display {
         int deviceFd;
         bool initialized;
         bool atomicSupported;
+        bool monotonicTimestamps = false;   // Whether event timestamps are on the same clock as std::chrono::steady_clock
+        bool crtcInVblankEvent = false;     // Whether page flip events name their CRTC, otherwise it comes back through the user data
 
         // DRM resources
         std::vector<std::shared_ptr<connector>> connectors;
@@ -450,10 +612,11 @@ namespace display {
         std::vector<std::shared_ptr<frameBuffer>> framebuffers;
 
         // Event handling
-        std::function<void(uint32_t, uint32_t, void*)> pageFlipHandler;
+        std::function<void(uint32_t, uint32_t, std::chrono::steady_clock::time_point, void*)> pageFlipHandler;
 
         // Atomic commit state
         void* atomicReq;
+        std::map<uint32_t, std::map<std::string, uint32_t>> propertyIds;   // By object and name, queried once per object on first use
 
         // Private methods
         bool openDevice();
@@ -487,18 +650,33 @@ namespace display {
 
         // Rendering context
         std::shared_ptr<frameBuffer> createFramebuffer(uint32_t width, uint32_t height, uint32_t format);
-        bool present(std::shared_ptr<connector> connector, std::shared_ptr<frameBuffer> fb);
+        std::shared_ptr<swapChain> createSwapChain(std::shared_ptr<connector> connector, uint32_t width, uint32_t height, size_t bufferCount);
+        void destroySwapChain(std::shared_ptr<swapChain> chain);
+        bool present(std::shared_ptr<swapChain> chain, const std::vector<types::rectangle>& damage = {});
+        bool retryFlip(std::shared_ptr<swapChain> chain);   // Flips a frame a busy CRTC turned down before, true while it still has to be retried
 
         // Event handling
         bool processEvents(int timeoutMs = 0);
+        int getEventFd();   // Becomes readable when DRM events such as page flip completions are pending, -1 when there is none
+        bool isHeadless();  // No DRM device was found, frames only end up in memory or a capture sink
         void setHotplugHandler(std::function<void(std::shared_ptr<connector>, bool)> handler);
 
         extern std::shared_ptr<device> Device;
         extern std::map<uint32_t, std::shared_ptr<connector>> activeDisplays;
+
+        // Bumped whenever activeDisplays or a display mode changes, so geometry derived from them knows when to be recomputed
+        extern std::atomic<uint64_t> configurationGeneration;
+
         extern std::function<void(std::shared_ptr<connector>, bool)> hotplugHandler;
 
+        // Swap chains by the CRTC they flip on, so page flip events find their way back
+        extern std::map<uint32_t, std::shared_ptr<swapChain>> swapChains;
+
         // Private methods
         bool setupDisplay(std::shared_ptr<connector> connector, const mode& mode);
+        std::shared_ptr<crtc> findCrtc(std::shared_ptr<connector> connector);
+        bool flush(swapChain& chain);
+        bool atomicFlip(swapChain& chain, std::shared_ptr<frameBuffer> fb);
         void handleHotplugEvent(std::shared_ptr<connector> connector, bool connected);
     };
 
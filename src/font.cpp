@@ -1,5 +1,6 @@
 #include "font.h"
 #include "logger.h"
+#include "window.h"
 
 #include <iostream>
 #include <fstream>
@@ -11,6 +12,10 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 namespace font {
 
     // UTF-8 to UTF-32 conversion
@@ -72,6 +77,134 @@ namespace font {
         return result;
     }
 
+    // Blending kernels work on plain byte streams: every destination channel byte gets its own alpha and foreground byte.
+    // This keeps them independent of the pixel layout, out = (fg * a + dst * (255 - a)) / 255 rounded to nearest.
+    using blendKernel = void (*)(uint8_t* dst, const uint8_t* alpha, const uint8_t* foreground, size_t count);
+
+    // Exact division by 255 with rounding for values up to 255 * 255
+    static inline uint32_t divide255(uint32_t value) {
+        value += 128;
+        return (value + (value >> 8)) >> 8;
+    }
+
+    static void blendBytesScalar(uint8_t* dst, const uint8_t* alpha, const uint8_t* foreground, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            uint32_t a = alpha[i];
+            dst[i] = static_cast<uint8_t>(divide255(foreground[i] * a + dst[i] * (255 - a)));
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // Blends 8 channels held in 16 bit lanes
+    __attribute__((target("sse2")))
+    static inline __m128i blendLanesSSE2(__m128i d, __m128i a, __m128i f) {
+        const __m128i full = _mm_set1_epi16(255);
+        const __m128i half = _mm_set1_epi16(128);
+
+        __m128i value = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(f, a), _mm_mullo_epi16(d, _mm_sub_epi16(full, a))), half);
+        return _mm_srli_epi16(_mm_add_epi16(value, _mm_srli_epi16(value, 8)), 8);
+    }
+
+    __attribute__((target("sse2")))
+    static void blendBytesSSE2(uint8_t* dst, const uint8_t* alpha, const uint8_t* foreground, size_t count) {
+        const __m128i zero = _mm_setzero_si128();
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(alpha + i));
+            __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(foreground + i));
+
+            __m128i low = blendLanesSSE2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(f, zero));
+            __m128i high = blendLanesSSE2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(f, zero));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(low, high));
+        }
+
+        blendBytesScalar(dst + i, alpha + i, foreground + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void blendBytesAVX2(uint8_t* dst, const uint8_t* alpha, const uint8_t* foreground, size_t count) {
+        const __m256i full = _mm256_set1_epi16(255);
+        const __m256i half = _mm256_set1_epi16(128);
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i)));
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(alpha + i)));
+            __m256i f = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(foreground + i)));
+
+            // Blends 16 channels held in 16 bit lanes
+            __m256i value = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(f, a), _mm256_mullo_epi16(d, _mm256_sub_epi16(full, a))), half);
+            __m256i result = _mm256_srli_epi16(_mm256_add_epi16(value, _mm256_srli_epi16(value, 8)), 8);
+
+            // Narrow the 16 lanes back to bytes, packus works per 128 bit half so the halves are packed together
+            __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+        }
+
+        blendBytesScalar(dst + i, alpha + i, foreground + i, count - i);
+    }
+#endif
+
+    // Picks the widest kernel the running CPU supports, other architectures (like ARM/NEON) use the scalar kernel which compilers auto-vectorize.
+    static blendKernel selectBlendKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return blendBytesAVX2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return blendBytesSSE2;
+        }
+#endif
+        return blendBytesScalar;
+    }
+
+    static const blendKernel blendBytes = selectBlendKernel();
+
+    // Number of pixels blended per kernel call, sized so the scratch rows stay on the stack
+    constexpr int blendChunkPixels = 64;
+
+    // Widest supported pixel, XRGB8888
+    constexpr int maxBlendChannels = 4;
+
+    // Codepoint ranges covered by the direct indexed glyph table, these dominate terminal traffic.
+    struct glyphRange {
+        char32_t first;
+        char32_t last;
+    };
+
+    static constexpr glyphRange commonGlyphRanges[] = {
+        {0x0020, 0x007E},   // Printable ASCII
+        {0x00A0, 0x00FF},   // Latin-1 supplement
+        {0x2500, 0x259F},   // Box drawing and block elements
+    };
+
+    static constexpr size_t commonGlyphCount() {
+        size_t count = 0;
+        for (const glyphRange& range : commonGlyphRanges) {
+            count += range.last - range.first + 1;
+        }
+        return count;
+    }
+
+    // Returns the slot of the codepoint in the glyph table, or -1 if it isn't one of the common codepoints.
+    static inline int glyphTableIndex(char32_t codepoint) {
+        int offset = 0;
+        for (const glyphRange& range : commonGlyphRanges) {
+            if (codepoint < range.first) {
+                return -1;
+            }
+            if (codepoint <= range.last) {
+                return offset + static_cast<int>(codepoint - range.first);
+            }
+            offset += static_cast<int>(range.last - range.first + 1);
+        }
+        return -1;
+    }
+
     // Font class implementation
     font::font(const std::string& FontPath, int FontSize) 
         : fontPath(FontPath), fontSize(FontSize), lineHeight(0), maxWidth(0), loaded(false),
@@ -90,6 +223,7 @@ namespace font {
         : fontPath(std::move(other.fontPath)), fontSize(other.fontSize), 
           lineHeight(other.lineHeight), maxWidth(other.maxWidth), loaded(other.loaded),
           ftLibrary(other.ftLibrary), ftFace(other.ftFace),
+          glyphTable(std::move(other.glyphTable)), glyphAtlas(std::move(other.glyphAtlas)),
           glyphCache(std::move(other.glyphCache)) {
         
         other.ftLibrary = nullptr;
@@ -108,6 +242,8 @@ namespace font {
             loaded = other.loaded;
             ftLibrary = other.ftLibrary;
             ftFace = other.ftFace;
+            glyphTable = std::move(other.glyphTable);
+            glyphAtlas = std::move(other.glyphAtlas);
             glyphCache = std::move(other.glyphCache);
             
             other.ftLibrary = nullptr;
@@ -174,23 +310,79 @@ namespace font {
         return true;
     }
 
-    glyph font::getGlyph(char32_t codepoint) {
+    const glyph* font::getGlyph(char32_t codepoint) {
+        // Common codepoints are served straight from the atlas table
+        int tableIndex = glyphTableIndex(codepoint);
+        if (tableIndex >= 0 && !glyphTable.empty()) {
+            const glyph& entry = glyphTable[tableIndex];
+            return entry.codepoint ? &entry : nullptr;
+        }
+
+        // The table above is read only after preloading, the hash map however grows on misses
+        std::lock_guard<std::mutex> lock(glyphCacheMutex);
+
         // Check cache first
         auto it = glyphCache.find(codepoint);
         if (it != glyphCache.end()) {
-            return it->second;
+            return &it->second;
         }
         
         // Load glyph if not in cache
         if (loadGlyph(codepoint)) {
-            return glyphCache[codepoint];
+            return &glyphCache.at(codepoint);
         }
         
-        // Return empty glyph if loading failed
-        return glyph{};
+        return nullptr;
     }
 
     bool font::loadGlyph(char32_t codepoint) {
+        glyph newGlyph;
+        if (!rasterizeGlyph(codepoint, newGlyph)) {
+            return false;
+        }
+
+        // Cache the glyph, moving the storage keeps the bitmap pointer valid
+        glyphCache[codepoint] = std::move(newGlyph);
+        
+        return true;
+    }
+
+    void font::preloadCommonGlyphs() {
+        if (!ftFace) {
+            return;
+        }
+
+        glyphTable.clear();
+        glyphTable.resize(commonGlyphCount());
+        glyphAtlas.clear();
+
+        // Atlas offsets are recorded first and turned into pointers once the atlas has stopped growing
+        std::vector<size_t> atlasOffsets(glyphTable.size(), 0);
+        size_t tableIndex = 0;
+
+        for (const glyphRange& range : commonGlyphRanges) {
+            for (char32_t codepoint = range.first; codepoint <= range.last; codepoint++, tableIndex++) {
+                glyph& entry = glyphTable[tableIndex];
+                if (!rasterizeGlyph(codepoint, entry)) {
+                    entry = glyph{};    // Leave the slot empty, zero codepoint marks it as missing
+                    continue;
+                }
+
+                atlasOffsets[tableIndex] = glyphAtlas.size();
+                glyphAtlas.insert(glyphAtlas.end(), entry.storage.begin(), entry.storage.end());
+                entry.storage = std::vector<uint8_t>();
+            }
+        }
+
+        for (size_t i = 0; i < glyphTable.size(); i++) {
+            glyph& entry = glyphTable[i];
+            entry.bitmap = (entry.codepoint && entry.width > 0 && entry.height > 0) ? glyphAtlas.data() + atlasOffsets[i] : nullptr;
+        }
+
+        LOG_VERBOSE() << "Preloaded " << glyphTable.size() << " common glyphs into a " << glyphAtlas.size() << " byte atlas" << std::endl;
+    }
+
+    bool font::rasterizeGlyph(char32_t codepoint, glyph& out) {
         if (!ftFace) {
             return false;
         }
@@ -220,30 +412,28 @@ namespace font {
             return false;
         }
         
-        // Create glyph structure
-        glyph newGlyph;
-        newGlyph.codepoint = codepoint;
-        newGlyph.width = face->glyph->bitmap.width;
-        newGlyph.height = face->glyph->bitmap.rows;
-        newGlyph.bearingX = face->glyph->bitmap_left;
-        newGlyph.bearingY = face->glyph->bitmap_top;
-        newGlyph.advance = face->glyph->advance.x >> 6;
+        // Fill glyph structure
+        out.codepoint = codepoint;
+        out.width = face->glyph->bitmap.width;
+        out.height = face->glyph->bitmap.rows;
+        out.bearingX = face->glyph->bitmap_left;
+        out.bearingY = face->glyph->bitmap_top;
+        out.advance = face->glyph->advance.x >> 6;
         
         // Copy bitmap data
-        size_t bitmapSize = newGlyph.width * newGlyph.height;
-        newGlyph.bitmap.resize(bitmapSize);
+        size_t bitmapSize = out.width * out.height;
+        out.storage.resize(bitmapSize);
         
         if (bitmapSize > 0) {
-            std::memcpy(newGlyph.bitmap.data(), face->glyph->bitmap.buffer, bitmapSize);
+            std::memcpy(out.storage.data(), face->glyph->bitmap.buffer, bitmapSize);
         }
-        
-        // Cache the glyph
-        glyphCache[codepoint] = newGlyph;
+
+        out.bitmap = bitmapSize > 0 ? out.storage.data() : nullptr;
         
         return true;
     }
 
-    cellRenderData font::renderCell(const types::Cell& cell, cellRenderData& cellData, float zoom) {
+    cellRenderData& font::renderCell(const types::Cell& cell, cellRenderData& cellData, float zoom) {
         // Convert UTF-8 to UTF-32
         char32_t codepoint = utf8ToUtf32(cell.utf);
         
@@ -253,20 +443,97 @@ namespace font {
         }
         
         // Get glyph
-        glyph glyphData = getGlyph(codepoint);
-        if (glyphData.bitmap.empty()) {
+        const glyph* glyphData = getGlyph(codepoint);
+        if (!glyphData || glyphData->empty()) {
             return cellData;
         }
         
         // Render glyph to cell
-        renderGlyphToCell(glyphData, cellData, cell.textColor, cellData.width, cellData.height, zoom);
+        renderGlyphToCell(*glyphData, cellData, cell.textColor, cellData.width, cellData.height, zoom);
         
         return cellData;
     }
 
+    void font::renderCell(const types::Cell& cell, uint32_t* pixels, int width, int height, int stride, float zoom) {
+        if (!pixels || width <= 0 || height <= 0) {
+            return;
+        }
+
+        // Background first, the glyph is then blended on top of it in place
+        const uint32_t background = types::toXRGB8888(cell.backgroundColor);
+        for (int y = 0; y < height; y++) {
+            std::fill(pixels + y * stride, pixels + y * stride + width, background);
+        }
+
+        char32_t codepoint = utf8ToUtf32(cell.utf);
+        if (codepoint == 0 || codepoint == 0x20) {
+            return;
+        }
+
+        const glyph* glyphData = getGlyph(codepoint);
+        if (!glyphData || glyphData->empty()) {
+            return;
+        }
+
+        // XRGB8888 in memory order, the X byte of both foreground and background is zero so blending keeps it zero
+        const uint32_t foreground = types::toXRGB8888(cell.textColor);
+        blendGlyph(*glyphData, reinterpret_cast<uint8_t*>(pixels), stride * sizeof(uint32_t), reinterpret_cast<const uint8_t*>(&foreground), sizeof(uint32_t), width, height, zoom);
+    }
+
+    // Zoom levels whose lookup tables each renderer thread keeps, windows are usually at one or two zooms at a time
+    constexpr size_t zoomIndexSlots = 4;
+
+    const std::vector<int>& font::getZoomIndex(float zoom, int length) {
+        struct zoomTable {
+            float zoom = 0.0f;          // 0 for a slot not used yet
+            std::vector<int> index;
+            uint64_t lastUse = 0;
+        };
+
+        // Per thread, so renderer threads never share a table which is being rebuilt
+        thread_local zoomTable tables[zoomIndexSlots];
+        thread_local uint64_t uses = 0;
+
+        // Rendering a zoomed window next to a normal one alternates between zooms, each keeps its own table.
+        // Only a zoom without a table takes over the least recently used one.
+        zoomTable* table = &tables[0];
+        for (zoomTable& candidate : tables) {
+            if (candidate.zoom == zoom) {
+                table = &candidate;
+                break;
+            }
+            if (candidate.lastUse < table->lastUse) {
+                table = &candidate;
+            }
+        }
+        table->lastUse = ++uses;
+
+        // Maps a scaled pixel offset back into the source glyph bitmap, rebuilt only for a new zoom or when more entries are needed
+        if (table->zoom != zoom || static_cast<int>(table->index.size()) < length) {
+            size_t first = table->zoom == zoom ? table->index.size() : 0;
+            table->index.resize(std::max(length, static_cast<int>(table->index.size())));
+
+            for (size_t i = first; i < table->index.size(); i++) {
+                table->index[i] = static_cast<int>(static_cast<float>(i) / zoom);
+            }
+
+            table->zoom = zoom;
+        }
+
+        return table->index;
+    }
+
     void font::renderGlyphToCell(const glyph& glyph, cellRenderData& cellData, const types::RGB& foreground, int cellWidth, int cellHeight, float zoom) {
+        if (cellData.pixels.size() < static_cast<size_t>(cellWidth * cellHeight)) {
+            return;
+        }
+
+        blendGlyph(glyph, reinterpret_cast<uint8_t*>(cellData.pixels.data()), cellWidth * sizeof(types::RGB), reinterpret_cast<const uint8_t*>(&foreground), sizeof(types::RGB), cellWidth, cellHeight, zoom);
+    }
+
+    void font::blendGlyph(const glyph& glyph, uint8_t* destination, size_t rowBytes, const uint8_t* foreground, int channels, int cellWidth, int cellHeight, float zoom) {
         
-        if (glyph.bitmap.empty()) {
+        if (glyph.empty()) {
             return;
         }
         
@@ -281,37 +548,47 @@ namespace font {
         // Ensure we don't go out of bounds
         startX = std::max(0, std::min(startX, cellWidth - glyphScaledWidth));
         startY = std::max(0, std::min(startY, cellHeight - glyphScaledHeight));
-        
-        // Render each pixel of the glyph
-        for (int y = 0; y < glyphScaledHeight && (startY + y) < cellHeight; y++) {
-            for (int x = 0; x < glyphScaledWidth && (startX + x) < cellWidth; x++) {
-                // Sample from the original glyph bitmap
-                int srcX = static_cast<int>(x / zoom);
-                int srcY = static_cast<int>(y / zoom);
-                
-                if (srcX >= glyph.width || srcY >= glyph.height) {
-                    continue;
+
+        const int visibleWidth = std::min(glyphScaledWidth, cellWidth - startX);
+        const int visibleHeight = std::min(glyphScaledHeight, cellHeight - startY);
+
+        if (visibleWidth <= 0 || visibleHeight <= 0 || channels <= 0 || channels > maxBlendChannels) {
+            return;
+        }
+
+        const std::vector<int>& sourceIndex = getZoomIndex(zoom, std::max(visibleWidth, visibleHeight));
+
+        // The foreground is the same for every pixel, so its byte pattern is built once per glyph
+        uint8_t foregroundBytes[blendChunkPixels * maxBlendChannels];
+        uint8_t alphaBytes[blendChunkPixels * maxBlendChannels];
+        for (int i = 0; i < blendChunkPixels; i++) {
+            std::memcpy(&foregroundBytes[i * channels], foreground, channels);
+        }
+        
+        // Blend the glyph row by row, expanding the sampled coverage to one alpha per channel
+        for (int y = 0; y < visibleHeight; y++) {
+            int srcY = sourceIndex[y];
+            if (srcY >= glyph.height) {
+                continue;
+            }
+
+            const uint8_t* sourceRow = glyph.bitmap + srcY * glyph.width;
+            uint8_t* destinationRow = destination + (startY + y) * rowBytes + startX * channels;
+
+            for (int chunkStart = 0; chunkStart < visibleWidth; chunkStart += blendChunkPixels) {
+                int chunkLength = std::min(blendChunkPixels, visibleWidth - chunkStart);
+                bool covered = false;
+
+                for (int x = 0; x < chunkLength; x++) {
+                    int srcX = sourceIndex[chunkStart + x];
+                    uint8_t alpha = srcX < glyph.width ? sourceRow[srcX] : 0;
+
+                    std::memset(&alphaBytes[x * channels], alpha, channels);
+                    covered |= alpha > 0;
                 }
-                
-                int srcIndex = srcY * glyph.width + srcX;
-                uint8_t alpha = glyph.bitmap[srcIndex];
-                
-                if (alpha > 0) {
-                    // Calculate destination pixel position
-                    int dstX = startX + x;
-                    int dstY = startY + y;
-                    int dstIndex = dstY * cellWidth + dstX;
-                    
-                    if (dstIndex < (signed)cellData.pixels.size()) {
-                        // Alpha blend the foreground color
-                        float alphaF = alpha / 255.0f;
-                        float invAlphaF = 1.0f - alphaF;
-                        
-                        types::RGB& dstPixel = cellData.pixels[dstIndex];
-                        dstPixel.r = static_cast<uint8_t>(foreground.r * alphaF + dstPixel.r * invAlphaF);
-                        dstPixel.g = static_cast<uint8_t>(foreground.g * alphaF + dstPixel.g * invAlphaF);
-                        dstPixel.b = static_cast<uint8_t>(foreground.b * alphaF + dstPixel.b * invAlphaF);
-                    }
+
+                if (covered) {
+                    blendBytes(destinationRow + chunkStart * channels, alphaBytes, foregroundBytes, static_cast<size_t>(chunkLength * channels));
                 }
             }
         }
@@ -421,6 +698,8 @@ namespace font {
                     return false;
                 }
                 
+                defaultFont->preloadCommonGlyphs();
+
                 // Register as default font
                 fontRegistry["default"] = defaultFont;
                 
@@ -457,6 +736,8 @@ namespace font {
                     return false;
                 }
                 
+                newFont->preloadCommonGlyphs();
+
                 defaultFont = newFont;
                 fontRegistry["default"] = newFont;
                 return true;
@@ -474,6 +755,8 @@ namespace font {
                     return false;
                 }
                 
+                newFont->preloadCommonGlyphs();
+
                 fontRegistry[fontName] = newFont;
                 return true;
                 
@@ -502,6 +785,9 @@ namespace font {
         void setDefaultCellSize(int width, int height) {
             defaultCellWidth = width;
             defaultCellHeight = height;
+
+            // Every cell rectangle in the layout table depends on this
+            window::invalidateLayout();
         }
     }
 
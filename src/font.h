@@ -7,17 +7,29 @@
 #include <cstdint>
 #include <memory>
 #include <unordered_map>
+#include <mutex>
 
 namespace font {
 
     struct glyph {
-        char32_t codepoint;             // UTF-32 codepoint
-        std::vector<uint8_t> bitmap;    // 8-bit grayscale bitmap
-        int width;
-        int height;
-        int bearingX;                   // Horizontal bearing (offset from baseline)
-        int bearingY;                   // Vertical bearing (offset from baseline)
-        int advance;                    // Horizontal advance to next glyph
+        char32_t codepoint = 0;             // UTF-32 codepoint
+        const uint8_t* bitmap = nullptr;    // 8-bit grayscale bitmap, points either into the font's atlas or into storage
+        std::vector<uint8_t> storage;       // Owns the bitmap of glyphs which are not part of the atlas
+        int width = 0;
+        int height = 0;
+        int bearingX = 0;                   // Horizontal bearing (offset from baseline)
+        int bearingY = 0;                   // Vertical bearing (offset from baseline)
+        int advance = 0;                    // Horizontal advance to next glyph
+
+        glyph() = default;
+
+        // A copy of storage would leave bitmap pointing into the original's, moving keeps the vector's buffer
+        glyph(const glyph&) = delete;
+        glyph& operator=(const glyph&) = delete;
+        glyph(glyph&&) noexcept = default;
+        glyph& operator=(glyph&&) noexcept = default;
+
+        bool empty() const { return bitmap == nullptr || width <= 0 || height <= 0; }
     };
 
     struct cellRenderData {
@@ -37,12 +49,18 @@ namespace font {
         font(font&&) noexcept;
         font& operator=(font&&) noexcept;
 
-        // Glyph operations
-        glyph getGlyph(char32_t codepoint);
+        // Glyph operations, the returned glyph is owned by the font and stays valid for its lifetime. Returns nullptr if the glyph can't be loaded.
+        const glyph* getGlyph(char32_t codepoint);
         bool loadGlyph(char32_t codepoint);
+
+        // Rasterizes the common terminal codepoints (ASCII, Latin-1, box drawing and block elements) into one contiguous atlas.
+        void preloadCommonGlyphs();
         
-        // Cell rendering - main function for rendering cells
-        cellRenderData renderCell(const types::Cell& cell, cellRenderData& cellData, float zoom = 1.0f);
+        // Cell rendering - main function for rendering cells, renders in place into cellData and returns it
+        cellRenderData& renderCell(const types::Cell& cell, cellRenderData& cellData, float zoom = 1.0f);
+
+        // Renders the cell background and glyph straight into XRGB8888 pixels, stride is in pixels so this can target a tile or a framebuffer.
+        void renderCell(const types::Cell& cell, uint32_t* pixels, int width, int height, int stride, float zoom = 1.0f);
         
         // Utility functions
         int getFontSize() const { return fontSize; }
@@ -65,16 +83,29 @@ namespace font {
         void* ftLibrary;
         void* ftFace;
         
-        // Glyph cache
+        // Direct indexed table for the common codepoints, their bitmaps live back to back in glyphAtlas
+        std::vector<glyph> glyphTable;
+        std::vector<uint8_t> glyphAtlas;
+
+        // Glyph cache for the rest, node based so pointers handed out by getGlyph survive rehashing
         std::unordered_map<char32_t, glyph> glyphCache;
+        std::mutex glyphCacheMutex;     // Cells may be rendered from several renderer threads at once
         
         // Private methods
         bool initializeFreeType();
         void cleanupFreeType();
         bool loadFontFile();
+        bool rasterizeGlyph(char32_t codepoint, glyph& out);
         void renderGlyphToCell(const glyph& glyph, cellRenderData& cellData, 
                               const types::RGB& foreground,
                               int cellWidth, int cellHeight, float zoom);
+
+        // Blends the glyph into any byte interleaved pixel layout, 'foreground' holds one pixel worth of 'channels' bytes.
+        void blendGlyph(const glyph& glyph, uint8_t* destination, size_t rowBytes, const uint8_t* foreground, int channels,
+                        int cellWidth, int cellHeight, float zoom);
+
+        // Scaled pixel offset to source bitmap offset lookup, the calling thread keeps one for each of the last few zooms it used
+        static const std::vector<int>& getZoomIndex(float zoom, int length);
     };
 
     // Global font manager
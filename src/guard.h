@@ -2,14 +2,16 @@
 #define _GUARD_H_
 
 #include <mutex>
+#include <shared_mutex>
 #include <memory>
-#include <functional>
+#include <cstdio>
+#include <exception>
 
 namespace atomic{
     template<typename T>
     class guard {
     public:
-        std::mutex shared; // Mutex to guard shared data
+        mutable std::shared_mutex shared; // Mutex to guard shared data, exclusive for writers and shared for readers
         std::unique_ptr<T> data;
 
         /**
@@ -23,23 +25,43 @@ namespace atomic{
         /**
          * @brief Functor to execute a job with thread safety.
          * 
-         * This operator() function takes a std::function that operates on a reference to a T object.
-         * It ensures that the job is executed with mutual exclusion by using a std::lock_guard to lock
-         * the mutex. If the job throws an exception, it catches it and reports the failure.
+         * This operator() function takes any callable that operates on a reference to a T object.
+         * It ensures that the job is executed with mutual exclusion by holding the mutex exclusively.
+         * If the job throws an exception, it catches it and reports the failure.
          * 
-         * @param job A std::function that takes a reference to a T object and performs some operation.
+         * @param job A callable that takes a reference to a T object and performs some operation.
          * 
          * @throws Any exception thrown by the job function will be caught and reported.
          */
-        void operator()(std::function<void(T&)> job) {
-            std::lock_guard<std::mutex> lock(shared); // Automatically manages mutex locking and unlocking
-            try {
-                job(*data);
-            } catch (const std::exception& e) {
-                perror(e.what());
-            } catch (...) {
-                perror("Unknown exception occurred in job execution!");
-            }
+        template<typename Job>
+        void operator()(Job&& job) {
+            std::unique_lock<std::shared_mutex> lock(shared); // Automatically manages mutex locking and unlocking
+            run(job, *data);
+        }
+
+        /**
+         * @brief Executes a job which only reads the data, alongside other readers.
+         * 
+         * @param job A callable that takes a const reference to a T object.
+         */
+        template<typename Job>
+        void read(Job&& job) const {
+            std::shared_lock<std::shared_mutex> lock(shared);
+            run(job, static_cast<const T&>(*data));
+        }
+
+        /**
+         * @brief Executes a job which may change the elements of the data but not its structure, alongside readers.
+         * 
+         * Nothing may be added, removed or reordered. Whatever element state the job changes has to be synchronized
+         * by the elements themselves.
+         * 
+         * @param job A callable that takes a reference to a T object.
+         */
+        template<typename Job>
+        void concurrent(Job&& job) {
+            std::shared_lock<std::shared_mutex> lock(shared);
+            run(job, *data);
         }
 
         /**
@@ -50,8 +72,8 @@ namespace atomic{
          * 
          * @return T A copy of the data.
          */
-        T read() {
-            std::lock_guard<std::mutex> lock(shared);
+        T read() const {
+            std::shared_lock<std::shared_mutex> lock(shared);
             return *data;
         }
 
@@ -64,9 +86,21 @@ namespace atomic{
          * released when the destructor exits, preventing potential deadlocks.
          */
         ~guard() {
-            std::lock_guard<std::mutex> lock(shared);
+            std::unique_lock<std::shared_mutex> lock(shared);
             data.reset(); // Ensures proper destruction
         }
+
+    private:
+        template<typename Job, typename Data>
+        static void run(Job& job, Data& target) {
+            try {
+                job(target);
+            } catch (const std::exception& e) {
+                perror(e.what());
+            } catch (...) {
+                perror("Unknown exception occurred in job execution!");
+            }
+        }
     };   
 }
 
@@ -645,7 +645,6 @@ namespace input {
     namespace manager {
         atomic::guard<DeviceManager> deviceManager;
         atomic::guard<EventProcessor> eventProcessor;
-        void* focusedHandle = nullptr;
 
         void init() {
             logger::info("Initializing input system...");
@@ -692,14 +691,6 @@ namespace input {
             LOG_INFO() << "Input system shutdown complete." << std::endl;
         }
 
-        void setFocusedHandle(void* handle) {
-            focusedHandle = handle;
-        }
-
-        void* getFocusedHandle() {
-            return focusedHandle;
-        }
-
         bool addInputDevice(const std::string& devicePath) {
             bool result = false;
             deviceManager([&result, &devicePath](DeviceManager& dm) {
@@ -741,33 +732,34 @@ namespace input {
         /**
          * @brief Sends an input event to the currently focused window handle.
          *
-         * This function checks if there is a focused handle and, if so, casts it to a window handle.
-         * It then prepares a packet buffer, copies the input event data into the buffer, and sends it
-         * through the handle's connection. If sending fails, an error is logged.
+         * This function prepares a packet buffer, copies the input event data into the buffer, and looks
+         * the focused handle up by its id. If the handle still exists, the packet is sent through its
+         * connection. If sending fails, an error is logged.
          *
          * @param inputEvent The input event to be sent to the focused handle.
          */
         void sendInputToFocusedHandle(const packet::input::base& inputEvent) {
-            if (focusedHandle) {
-                // Cast to window::handle* and send the input event
-                window::handle* handle = static_cast<window::handle*>(focusedHandle);
-                if (handle->connection.getHandle() >= 0) {
-                    // Create packet buffer and copy input event into it
-                    char packetBuffer[packet::size];
-                    packet::input::base* inputPacket = new(packetBuffer) packet::input::base();
-                    
-                    // Copy the input event data
-                    inputPacket->mouse = inputEvent.mouse;
-                    inputPacket->modifiers = inputEvent.modifiers;
-                    inputPacket->additional = inputEvent.additional;
-                    inputPacket->key = inputEvent.key;
-                    
-                    if (!handle->connection.Send<char>(packetBuffer, packet::size)) {
-                        LOG_ERROR() << "Failed to send input event to focused handle" << std::endl;
-                        return;
-                    }
+            // Create packet buffer and copy input event into it
+            char packetBuffer[packet::size];
+            packet::input::base* inputPacket = new(packetBuffer) packet::input::base();
+            
+            // Copy the input event data
+            inputPacket->mouse = inputEvent.mouse;
+            inputPacket->modifiers = inputEvent.modifiers;
+            inputPacket->additional = inputEvent.additional;
+            inputPacket->key = inputEvent.key;
+
+            // Resolved under the handle lock, so the window can't be removed while its input is sent
+            window::manager::handles.read([&packetBuffer](const window::handleStore& self) {
+                window::handle* handle = self.get(window::manager::getFocusedHandleId());
+                if (!handle || handle->connection.isClosed()) {
+                    return;
                 }
-            }
+
+                if (!handle->connection.SendFrame(packet::type::INPUT, packetBuffer, packet::size)) {
+                    LOG_ERROR() << "Failed to send input event to focused handle" << std::endl;
+                }
+            });
         }
     }
 
@@ -202,16 +202,9 @@ namespace input {
         extern atomic::guard<DeviceManager> deviceManager;
         extern atomic::guard<EventProcessor> eventProcessor;
         
-        // Forward declaration for window handle
-        extern void* focusedHandle;  // Using void* to avoid circular dependency
-        
         void init();
         void exit();
         
-        // Focus management
-        void setFocusedHandle(void* handle);
-        void* getFocusedHandle();
-        
         // Device management
         bool addInputDevice(const std::string& devicePath);
         bool removeInputDevice(const std::string& devicePath);
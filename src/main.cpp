@@ -42,7 +42,7 @@ int main(int argc, char* argv[]) {
     // Keep the main thread alive and check for shutdown conditions
     while (true) {
     // Example: synthesize an action and execute (kept as reference)
-    // if (window::manager::getFocusedHandle()){
+    // if (window::manager::getActiveHandleCount()){
     //     config::Action a(config::ActionBits::MOVE | config::ActionBits::DIR_UP);
     //     a.execute();
     // }
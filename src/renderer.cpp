@@ -4,6 +4,7 @@
 #include "font.h"
 #include "logger.h"
 #include "config.h"
+#include "capture.h"
 
 #include <thread>
 #include <iostream>
@@ -11,61 +12,301 @@
 #include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <sstream>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 namespace renderer {
     
-    // Optimized cell cache with pre-converted framebuffer data
-    struct OptimizedCellCache {
-        types::Cell cellID;                    // Cell fingerprint for O(1) comparison
-        std::vector<uint32_t> XRGBPixels;      // Pre-converted XRGB8888 data
-        int width;
-        int height;
-        bool isValid;
-        
-        OptimizedCellCache() : width(0), height(0), isValid(false) {}
-        
-        // Fast initialization with pre-allocated size
-        void initialize(int w, int h) {
+    // Rendered cell in XRGB8888, ready to be memcpy'd row by row into the framebuffer
+    struct cellTile {
+        std::vector<uint32_t> XRGBPixels;
+        int width = 0;
+        int height = 0;
+
+        // Renders the cell straight into the tile's XRGB8888 pixels
+        void render(const types::Cell& cell, font::font* cellFont, int w, int h, float zoom) {
+            XRGBPixels.resize(static_cast<size_t>(w * h));
             width = w;
             height = h;
-            XRGBPixels.resize(w * h);
-            isValid = false;
+
+            if (cellFont) {
+                cellFont->renderCell(cell, XRGBPixels.data(), width, height, width, zoom);
+            }
+            else {
+                std::fill(XRGBPixels.begin(), XRGBPixels.end(), types::toXRGB8888(cell.backgroundColor));
+            }
         }
-        
-        // Convert RGB cell data to XRGB8888 format for direct framebuffer copying
-        void convertFromRGB(const font::cellRenderData& cellData) {
-            if (XRGBPixels.size() != static_cast<size_t>(cellData.width * cellData.height)) {
-                XRGBPixels.resize(cellData.width * cellData.height);
+    };
+
+    // Everything that affects how a cell tile looks, the cell itself carries the codepoint and both colors.
+    struct tileKey {
+        types::Cell cell;
+        float zoom;
+        const font::font* owner;
+        int width;
+        int height;
+
+        bool operator==(const tileKey& other) const {
+            return cell == other.cell && zoom == other.zoom && owner == other.owner && width == other.width && height == other.height;
+        }
+    };
+
+    struct tileKeyHash {
+        size_t operator()(const tileKey& key) const {
+            uint32_t utf;
+            uint32_t zoomBits;
+            std::memcpy(&utf, key.cell.utf, sizeof(utf));
+            std::memcpy(&zoomBits, &key.zoom, sizeof(zoomBits));
+
+            uint64_t colors = (static_cast<uint64_t>(types::toXRGB8888(key.cell.textColor)) << 32) | types::toXRGB8888(key.cell.backgroundColor);
+
+            size_t hash = std::hash<uint64_t>()(colors);
+            hash ^= std::hash<uint64_t>()((static_cast<uint64_t>(utf) << 32) | zoomBits) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+            hash ^= std::hash<const void*>()(key.owner) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+            hash ^= std::hash<uint64_t>()((static_cast<uint64_t>(key.width) << 32) | static_cast<uint32_t>(key.height)) + (hash << 6) + (hash >> 2);
+            return hash;
+        }
+    };
+
+    // Bounded cache of rendered cell tiles which persists across frames and handles, slots are recycled with the CLOCK algorithm.
+    class tileCache {
+    public:
+        explicit tileCache(size_t maxTiles) : capacity(maxTiles) {
+            slots.reserve(capacity);
+            index.reserve(capacity);
+        }
+
+        // Returns the tile for the given key, on a miss the returned tile is empty and 'fresh' is set so the caller renders into it.
+        cellTile& acquire(const tileKey& key, bool& fresh) {
+            auto it = index.find(key);
+            if (it != index.end()) {
+                slot& hit = slots[it->second];
+                hit.referenced = true;
+                counters.hits++;
+                fresh = false;
+                return hit.tile;
             }
-            
-            const size_t pixelCount = cellData.pixels.size();
-            for (size_t i = 0; i < pixelCount; i++) {
-                XRGBPixels[i] = types::toXRGB8888(cellData.pixels[i]);
+
+            counters.misses++;
+            fresh = true;
+
+            size_t slotIndex;
+            if (slots.size() < capacity) {
+                slotIndex = slots.size();
+                slots.emplace_back();
             }
-            
-            width = cellData.width;
-            height = cellData.height;
-            isValid = true;
+            else {
+                slotIndex = evict();
+            }
+
+            slot& target = slots[slotIndex];
+            target.key = key;
+            target.referenced = true;
+            index.emplace(key, slotIndex);
+            return target.tile;
+        }
+
+        void clear() {
+            slots.clear();
+            index.clear();
+            hand = 0;
+        }
+
+        tileCacheStats stats() const {
+            tileCacheStats result = counters;
+            result.size = slots.size();
+            result.capacity = capacity;
+            return result;
+        }
+
+    private:
+        struct slot {
+            tileKey key;
+            cellTile tile;          // Pixel storage is kept on eviction, so recycled slots of the same size don't reallocate
+            bool referenced = false;
+        };
+
+        // Sweeps the clock hand past recently used slots and frees the first one which has not been touched since the last sweep.
+        size_t evict() {
+            while (slots[hand].referenced) {
+                slots[hand].referenced = false;
+                hand = (hand + 1) % slots.size();
+            }
+
+            size_t victim = hand;
+            hand = (hand + 1) % slots.size();
+
+            index.erase(slots[victim].key);
+            counters.evictions++;
+            return victim;
+        }
+
+        size_t capacity;
+        size_t hand = 0;
+        std::vector<slot> slots;
+        std::unordered_map<tileKey, size_t, tileKeyHash> index;
+        tileCacheStats counters;
+    };
+
+    // Roughly 1-5 MB depending on cell size and zoom, which fits a few fonts worth of colored glyphs.
+    constexpr size_t maxCachedTiles = 4096;
+
+    // Fixed set of render threads which split the rows of a window into bands. Bands are claimed from a shared counter, so
+    // threads which finish early keep taking work from slower ones. The calling thread takes part as worker 0.
+    class bandPool {
+    public:
+        using job = std::function<void(size_t band, size_t worker)>;
+
+        ~bandPool() {
+            stop();
+        }
+
+        void start(size_t threadCount) {
+            stop();
+            stopping = false;
+
+            for (size_t worker = 1; worker < threadCount; worker++) {
+                threads.emplace_back(&bandPool::workerLoop, this, worker);
+            }
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+
+            for (std::thread& thread : threads) {
+                if (thread.joinable()) {
+                    thread.join();
+                }
+            }
+            threads.clear();
+        }
+
+        // Including the calling thread
+        size_t size() const {
+            return threads.size() + 1;
+        }
+
+        // Runs 'work' for every band in [0, count) and returns once all of them are done.
+        void run(size_t count, const job& work) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                currentJob = &work;
+                bandCount = count;
+                nextBand = 0;
+                pendingWorkers = threads.size();
+                generation++;
+            }
+            wake.notify_all();
+
+            drain(0);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]() { return pendingWorkers == 0; });
+            currentJob = nullptr;
         }
+
+    private:
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        const job* currentJob = nullptr;
+        size_t bandCount = 0;
+        std::atomic<size_t> nextBand{0};
+        size_t pendingWorkers = 0;
+        size_t generation = 0;
+        bool stopping = false;
+
+        void drain(size_t worker) {
+            for (size_t band = nextBand.fetch_add(1); band < bandCount; band = nextBand.fetch_add(1)) {
+                (*currentJob)(band, worker);
+            }
+        }
+
+        void workerLoop(size_t worker) {
+            size_t seenGeneration = 0;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                wake.wait(lock, [&]() { return stopping || generation != seenGeneration; });
+                if (generation == seenGeneration) {
+                    return;     // Woken up only for stopping
+                }
+                seenGeneration = generation;
+
+                lock.unlock();
+                drain(worker);
+                lock.lock();
+
+                if (--pendingWorkers == 0) {
+                    done.notify_one();
+                }
+            }
+        }
+    };
+
+    constexpr size_t bandsPerThread = 2;    // More bands than threads lets fast threads pick up the slack of slow ones
+    static size_t parallelThresholdCells = 0;
+
+    // Accumulated band render times since the last stats log
+    struct bandTiming {
+        std::chrono::microseconds total{0};
+        std::chrono::microseconds longest{0};
+        size_t samples = 0;
+    };
+
+    // Everything a band needs to render its rows of a handle, resolved once per handle on the thread drawing its display
+    struct bandJob {
+        const window::handle* handle;
+        font::font* cellFont;
+        tileCache* tiles;       // One cache per worker of the pipeline's band pool
+        uint32_t* fbBuffer;
+        int fbStride;           // In pixels
+        int fbHeight;
+        types::rectangle cellRect;
+        types::rectangle pixelRect;
+        int cellWidth;
+        int cellHeight;
+        int maxX;
+        int maxY;
+        bool fullRedraw;
+    };
+
+    struct bandResult {
+        std::vector<types::rectangle> damage;
+        int renderedCells = 0;
+        std::chrono::microseconds duration{0};
     };
     
     // Fast framebuffer blitting using memcpy for row-based operations
-    inline void blitCellToFramebuffer(uint32_t* fbBuffer, int fbWidth, int fbHeight, int startX, int startY, const OptimizedCellCache& cache) {
+    inline void blitCellToFramebuffer(uint32_t* fbBuffer, int fbWidth, int fbHeight, int startX, int startY, const cellTile& tile) {
         // Bounds checking
-        if (startX >= fbWidth || startY >= fbHeight || !cache.isValid) {
+        if (startX >= fbWidth || startY >= fbHeight || tile.XRGBPixels.empty()) {
             return;
         }
         
-        const int maxCopyWidth = std::min(cache.width, fbWidth - startX);
-        const int maxCopyHeight = std::min(cache.height, fbHeight - startY);
+        const int maxCopyWidth = std::min(tile.width, fbWidth - startX);
+        const int maxCopyHeight = std::min(tile.height, fbHeight - startY);
         
         // Memory operation batching - copy entire rows with memcpy
         for (int y = 0; y < maxCopyHeight; y++) {
-            const int srcOffset = y * cache.width;
+            const int srcOffset = y * tile.width;
             const int dstOffset = (startY + y) * fbWidth + startX;
             
             // Fast row-based copy using memcpy instead of pixel-by-pixel
-            std::memcpy(&fbBuffer[dstOffset], &cache.XRGBPixels[srcOffset], 
+            std::memcpy(&fbBuffer[dstOffset], &tile.XRGBPixels[srcOffset], 
                        maxCopyWidth * sizeof(uint32_t));
         }
     }
@@ -125,23 +366,120 @@ namespace renderer {
         }
     }
     
+    // Appends a damaged pixel rectangle, merging it into the previous one when they stack vertically with equal spans.
+    inline void addDamage(std::vector<types::rectangle>& damage, const types::rectangle& rect) {
+        if (rect.size.x <= 0 || rect.size.y <= 0) {
+            return;
+        }
+
+        if (!damage.empty()) {
+            types::rectangle& last = damage.back();
+            if (last.position.x == rect.position.x && last.size.x == rect.size.x && last.position.y + last.size.y == rect.position.y) {
+                last.size.y += rect.size.y;
+                return;
+            }
+        }
+
+        damage.push_back(rect);
+    }
+    
+    /*
+    Draws the handles of one active display into that display's own swap chain. Pipelines share nothing they write to
+    while drawing, so the displays of a multi-head setup are drawn side by side, each paced by the flips of its own CRTC.
+    */
+    struct pipeline {
+        std::shared_ptr<display::connector> connector;
+        std::shared_ptr<display::swapChain> chain;
+        std::shared_ptr<display::frameBuffer> framebuffer;  // Back buffer of the frame being drawn, nullptr while none is free
+        std::vector<window::handle*> handles;               // Handles shown on this display this frame, in draw order
+        std::vector<types::rectangle> damage;               // Pixel rectangles touched during the current frame
+        std::vector<types::rectangle> handleDamage;         // Pixel rectangles the last renderHandle call drew, also part of damage
+        bool needsPresent = false;
+        uint64_t loggedPresentFrame = 0;                    // Latest frame whose present timing made it into the stats log
+
+        bandPool pool;
+        std::vector<tileCache> tiles;                       // One cache per band worker, so tiles are never evicted while another thread is still copying them out
+        std::vector<bandResult> bandResults;                // Reused between frames so bands don't allocate their damage lists each time
+        std::vector<bandTiming> bandTimings;                // Accumulated since the last stats log
+    };
+
     // Renderer state
-    static std::shared_ptr<display::frameBuffer> currentFramebuffer;
-    static std::shared_ptr<display::connector> primaryConnector;
-    static std::shared_ptr<display::crtc> primaryCrtc;
-    static std::shared_ptr<display::plane> primaryPlane;
-    static std::unique_ptr<display::mode> currentMode;
+    static std::vector<std::unique_ptr<pipeline>> pipelines;   // In the order of display::manager::activeDisplays, so the first one is the primary display
+    static uint64_t pipelineGeneration = 0;                     // display::manager::configurationGeneration the pipelines were built for
+    static bandPool pipelinePool;                               // Draws the pipelines of several displays at once
     static bool rendererInitialized = false;
     static bool shouldExit = false;  // Flag to control renderer thread exit
+    static int wakeFd = -1;                 // eventfd the renderer thread sleeps on between frames
+    static std::chrono::nanoseconds minFrameInterval{0};      // Configured frame rate cap
+    static std::chrono::nanoseconds refreshFrameInterval{0};  // Frame rate cap for displays without vblank timing
+    static std::chrono::nanoseconds frameBudget{0};           // Time from starting a frame to presenting it, decays slowly after slow frames
+
+    // Leeway for waking up late and for the flip to be latched ahead of the vblank
+    constexpr std::chrono::microseconds vblankMargin{1500};
+
+    // How long to sleep before flipping again on a CRTC which was busy with a flip that wasn't ours
+    constexpr int flipRetryIntervalMs = 2;
+
+    tileCacheStats getTileCacheStats() {
+        tileCacheStats total;
+        for (const auto& target : pipelines) {
+            for (const tileCache& cache : target->tiles) {
+                tileCacheStats workerStats = cache.stats();
+                total.hits += workerStats.hits;
+                total.misses += workerStats.misses;
+                total.evictions += workerStats.evictions;
+                total.size += workerStats.size;
+                total.capacity += workerStats.capacity;
+            }
+        }
+        return total;
+    }
+
+    // The pipeline of the display a handle is on, handles of unknown displays are shown on the primary one like the layout does
+    static pipeline* pipelineOf(const window::handle& handle) {
+        if (pipelines.empty()) {
+            return nullptr;
+        }
+
+        for (const auto& target : pipelines) {
+            if (target->connector->getId() == handle.displayId) {
+                return target.get();
+            }
+        }
+        return pipelines.front().get();
+    }
+
+    void wake() {
+        if (wakeFd >= 0) {
+            uint64_t one = 1;
+            [[maybe_unused]] ssize_t written = write(wakeFd, &one, sizeof(one));
+        }
+    }
+
+    // Blocks until a watched socket receives data or the renderer is woken up, the ready descriptors are left in readyFds.
+    static void waitForWork(std::vector<int>& readyFds, int timeoutMs) {
+        if (window::manager::connections.wait(readyFds, timeoutMs) < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(16));     // Don't spin if waiting itself is broken
+            return;
+        }
+
+        // Drain the wake counter, so the next wait blocks again
+        if (std::find(readyFds.begin(), readyFds.end(), wakeFd) != readyFds.end()) {
+            uint64_t count;
+            [[maybe_unused]] ssize_t readBytes = read(wakeFd, &count, sizeof(count));
+        }
+
+        std::sort(readyFds.begin(), readyFds.end());
+    }
     
     // Forward declaration - kept for backward compatibility
     void renderCellToFramebuffer(uint32_t* fbBuffer, int fbWidth, int fbHeight, int startX, int startY, const font::cellRenderData& cellData);
     
-    inline bool clearOccupiedArea(window::handle* currentHandle) {
-        if (!currentFramebuffer) return false;    // ensure the frame buffer exists
+    inline bool clearOccupiedArea(pipeline& target, window::handle* currentHandle) {
+        if (!target.framebuffer) return false;    // ensure the frame buffer exists
         
         // first let's cast the frame buffer void ptr into an RGB8888 cast
-        uint32_t* pixelBuffer = static_cast<uint32_t*>(currentFramebuffer->getBuffer());
+        uint32_t* pixelBuffer = static_cast<uint32_t*>(target.framebuffer->getBuffer());
 
         if (!pixelBuffer) return false;   // ensure the pixel buffer exists
         
@@ -165,7 +503,7 @@ namespace renderer {
         else
             return false; // Nothing to clear
 
-        types::iVector2 currentFramebufferArea = currentFramebuffer->getRenderableArea();
+        types::iVector2 currentFramebufferArea = target.framebuffer->getRenderableArea();
 
         // Prepare the clear buffer using helper function
         ClearBufferData clearData = prepareClearBuffer(fillableArea, backgroundColor, currentFramebufferArea);
@@ -183,10 +521,438 @@ namespace renderer {
             clearData.clearHeight, 
             clearData.clearBuffer
         );
+
+        addDamage(target.damage, {{clearData.startX, clearData.startY}, {clearData.clearWidth, clearData.clearHeight}});
         
         return true;
     }
 
+    // Where renderHandle puts the cells of a handle on the framebuffer
+    struct cellPlacement {
+        types::iVector2 origin;     // Pixel position of the first cell
+        int cellWidth;
+        int cellHeight;
+        int columns;
+        int rows;
+    };
+
+    static cellPlacement placementOf(const window::handle& handle) {
+        types::rectangle cellRect = handle.getCellCoordinates();
+        types::rectangle pixelRect = handle.getPixelCoordinates();
+
+        return {
+            {pixelRect.position.x, pixelRect.position.y},
+            static_cast<int>(font::manager::getDefaultCellWidth() * handle.zoom),
+            static_cast<int>(font::manager::getDefaultCellHeight() * handle.zoom),
+            cellRect.size.x,
+            cellRect.size.y
+        };
+    }
+
+    // Whether renderHandle paints every cell of the handle, so that it hides whatever lies below it
+    static bool paintsWholeArea(const window::handle& handle, const cellPlacement& placement) {
+        return !handle.connection.isClosed() &&
+               !window::stain::has(handle.dirty, window::stain::type::closed) &&
+               handle.deltaBaseValid &&     // A full frame of the current size has arrived
+               handle.cellBuffer && handle.cellBuffer->size() == static_cast<size_t>(placement.columns) * static_cast<size_t>(placement.rows);
+    }
+
+    static int divideDown(int value, int divisor) {
+        return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+    }
+
+    static int divideUp(int value, int divisor) {
+        return value >= 0 ? (value + divisor - 1) / divisor : -(-value / divisor);
+    }
+
+    // Reused between frames, so recomputing the coverage doesn't allocate while nothing moves
+    static window::coverage coverageScratch;
+
+    /*
+    Scratch space for the union of the handles above one handle. Their edges split its area into a grid of blocks which
+    are each either completely covered or not at all, uncovered counts the uncovered blocks as a 2D prefix sum.
+    */
+    struct coverageGrid {
+        std::vector<types::rectangle> rects;    // Pixels painted by the handles above, relative to the lower handle and clipped to it
+        std::vector<int> edgesX;
+        std::vector<int> edgesY;
+        std::vector<int> uncovered;             // (edgesY.size()) x (edgesX.size()), row and column 0 are zero
+        std::vector<int> columnBlocks;          // Per cell column, the first block it overlaps and the one past its last
+        std::vector<int> rowBlocks;             // Same for cell rows
+
+        // Blocks [first, end) of the edges which a span of pixels [begin, begin + length) overlaps, stored as two entries
+        static void spanBlocks(const std::vector<int>& edges, int cells, int length, std::vector<int>& blocks) {
+            blocks.resize(static_cast<size_t>(cells) * 2);
+            for (int cell = 0; cell < cells; cell++) {
+                int begin = cell * length;
+                blocks[cell * 2] = static_cast<int>(std::upper_bound(edges.begin(), edges.end(), begin) - edges.begin()) - 1;
+                blocks[cell * 2 + 1] = static_cast<int>(std::lower_bound(edges.begin(), edges.end(), begin + length) - edges.begin());
+            }
+        }
+    };
+    static coverageGrid coverageUnion;
+
+    // Marks the cells of every handle which the handles drawn above it on the same display cover completely, together or alone.
+    static void updateCoverage(window::handleStore& self) {
+        coverageGrid& grid = coverageUnion;
+
+        for (size_t lowerIndex = 0; lowerIndex < self.size(); lowerIndex++) {
+            window::handle& lower = self[lowerIndex];
+            cellPlacement below = placementOf(lower);
+
+            window::coverage& next = coverageScratch;
+            next.hidden.clear();
+            next.hiddenCount = 0;
+
+            grid.rects.clear();
+            const int width = below.columns * below.cellWidth;
+            const int height = below.rows * below.cellHeight;
+
+            if (below.columns > 0 && below.rows > 0 && below.cellWidth > 0 && below.cellHeight > 0) {
+                for (size_t upperIndex = lowerIndex + 1; upperIndex < self.size(); upperIndex++) {
+                    const window::handle& upper = self[upperIndex];
+                    if (upper.displayId != lower.displayId) {
+                        continue;
+                    }
+
+                    cellPlacement above = placementOf(upper);
+                    if (!paintsWholeArea(upper, above)) {
+                        continue;
+                    }
+
+                    // The pixels the upper one paints, within the cells of the lower handle
+                    int left = std::clamp(above.origin.x - below.origin.x, 0, width);
+                    int top = std::clamp(above.origin.y - below.origin.y, 0, height);
+                    int right = std::clamp(above.origin.x - below.origin.x + above.columns * above.cellWidth, left, width);
+                    int bottom = std::clamp(above.origin.y - below.origin.y + above.rows * above.cellHeight, top, height);
+
+                    if (left < right && top < bottom) {
+                        grid.rects.push_back({{left, top}, {right - left, bottom - top}});
+                    }
+                }
+            }
+
+            if (!grid.rects.empty()) {
+                grid.edgesX.assign({0, width});
+                grid.edgesY.assign({0, height});
+                for (const types::rectangle& rect : grid.rects) {
+                    grid.edgesX.push_back(rect.position.x);
+                    grid.edgesX.push_back(rect.position.x + rect.size.x);
+                    grid.edgesY.push_back(rect.position.y);
+                    grid.edgesY.push_back(rect.position.y + rect.size.y);
+                }
+                std::sort(grid.edgesX.begin(), grid.edgesX.end());
+                grid.edgesX.erase(std::unique(grid.edgesX.begin(), grid.edgesX.end()), grid.edgesX.end());
+                std::sort(grid.edgesY.begin(), grid.edgesY.end());
+                grid.edgesY.erase(std::unique(grid.edgesY.begin(), grid.edgesY.end()), grid.edgesY.end());
+
+                // Blocks are indexed from 1 within the prefix sum, block (x, y) starts at edge (x - 1, y - 1)
+                const size_t stride = grid.edgesX.size();
+                const int blocksX = static_cast<int>(grid.edgesX.size()) - 1;
+                const int blocksY = static_cast<int>(grid.edgesY.size()) - 1;
+                grid.uncovered.assign(stride * grid.edgesY.size(), 1);
+
+                for (const types::rectangle& rect : grid.rects) {
+                    int firstX = static_cast<int>(std::lower_bound(grid.edgesX.begin(), grid.edgesX.end(), rect.position.x) - grid.edgesX.begin());
+                    int endX = static_cast<int>(std::lower_bound(grid.edgesX.begin(), grid.edgesX.end(), rect.position.x + rect.size.x) - grid.edgesX.begin());
+                    int firstY = static_cast<int>(std::lower_bound(grid.edgesY.begin(), grid.edgesY.end(), rect.position.y) - grid.edgesY.begin());
+                    int endY = static_cast<int>(std::lower_bound(grid.edgesY.begin(), grid.edgesY.end(), rect.position.y + rect.size.y) - grid.edgesY.begin());
+
+                    for (int y = firstY; y < endY; y++) {
+                        for (int x = firstX; x < endX; x++) {
+                            grid.uncovered[(y + 1) * stride + x + 1] = 0;
+                        }
+                    }
+                }
+
+                for (int y = 0; y <= blocksY; y++) {
+                    for (int x = 0; x <= blocksX; x++) {
+                        int& sum = grid.uncovered[y * stride + x];
+                        if (x == 0 || y == 0) {
+                            sum = 0;
+                            continue;
+                        }
+                        sum += grid.uncovered[(y - 1) * stride + x] + grid.uncovered[y * stride + x - 1] - grid.uncovered[(y - 1) * stride + x - 1];
+                    }
+                }
+
+                coverageGrid::spanBlocks(grid.edgesX, below.columns, below.cellWidth, grid.columnBlocks);
+                coverageGrid::spanBlocks(grid.edgesY, below.rows, below.cellHeight, grid.rowBlocks);
+
+                // A cell is hidden when none of the blocks it overlaps is uncovered
+                for (int y = 0; y < below.rows; y++) {
+                    const int firstY = grid.rowBlocks[y * 2];
+                    const int endY = grid.rowBlocks[y * 2 + 1];
+
+                    for (int x = 0; x < below.columns; x++) {
+                        const int firstX = grid.columnBlocks[x * 2];
+                        const int endX = grid.columnBlocks[x * 2 + 1];
+
+                        int uncovered = grid.uncovered[endY * stride + endX] - grid.uncovered[firstY * stride + endX]
+                                      - grid.uncovered[endY * stride + firstX] + grid.uncovered[firstY * stride + firstX];
+                        if (uncovered != 0) {
+                            continue;
+                        }
+
+                        if (next.hidden.empty()) {
+                            next.hidden.assign(static_cast<size_t>(below.columns) * static_cast<size_t>(below.rows), 0);
+                        }
+                        next.hidden[static_cast<size_t>(y) * below.columns + x] = 1;
+                        next.hiddenCount++;
+                    }
+                }
+            }
+
+            bool revealed = false;
+            {
+                std::lock_guard<std::mutex> lock(lower.cellBufferMutex);
+
+                window::coverage& current = lower.visibility;
+                if (current.hidden == next.hidden) {
+                    continue;
+                }
+
+                // Cells coming out from under another handle were drawn over or never drawn at all
+                if (current.hidden.empty() || next.hidden.empty() || current.hidden.size() == next.hidden.size()) {
+                    for (size_t cell = 0; cell < current.hidden.size() && !revealed; cell++) {
+                        revealed = current.hidden[cell] && !next.isHidden(cell);
+                    }
+                }
+                else {
+                    revealed = true;
+                }
+
+                if (revealed) {
+                    lower.presented.invalidate();
+                }
+
+                std::swap(current, next);
+            }
+
+            // Encoded frames received while the handle was completely covered were kept aside, it's visible again now
+            if (revealed && !lower.visibility.full()) {
+                lower.decodeDeferred();
+            }
+        }
+    }
+
+    static bool renderHandle(pipeline& target, const window::handle* handle);
+
+    /*
+    Picks when to start the next frame: as late as possible while still making the next vblank of the soonest display
+    which can take a frame, so it shows the freshest client data. Displays with every buffer taken are woken up by their
+    flip event anyway. Frames which don't make it are counted by the swap chain once they are presented.
+    */
+    static std::chrono::steady_clock::time_point scheduleFrameStart(std::chrono::steady_clock::time_point lastFrameStart) {
+        auto now = std::chrono::steady_clock::now();
+        auto earliest = lastFrameStart + minFrameInterval;
+
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (const auto& target : pipelines) {
+            if (!target->chain->canAcquire()) {
+                continue;
+            }
+
+            auto vblank = target->chain->nextVblank(now);
+            if (vblank == now) {
+                // No flip has completed yet, or there is no vblank to go by like in headless mode
+                return std::max(earliest, lastFrameStart + refreshFrameInterval);
+            }
+            deadline = std::min(deadline, vblank);
+        }
+
+        if (deadline == std::chrono::steady_clock::time_point::max()) {
+            return earliest;
+        }
+
+        return std::max(earliest, deadline - frameBudget - vblankMargin);
+    }
+
+    // Summarizes the present timings recorded since the last call for the stats log
+    static void logPresentTimings(pipeline& target) {
+        size_t frames = 0;
+        size_t missed = 0;
+        std::chrono::microseconds totalLatency{0};
+        std::chrono::microseconds longestLatency{0};
+
+        for (const display::presentTiming& timing : target.chain->getPresentTimings()) {
+            if (timing.frame <= target.loggedPresentFrame) {
+                continue;
+            }
+
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(timing.presented - timing.submitted);
+            totalLatency += latency;
+            longestLatency = std::max(longestLatency, latency);
+            missed += timing.missed;
+            frames++;
+
+            target.loggedPresentFrame = timing.frame;
+        }
+
+        if (frames == 0) {
+            return;
+        }
+
+        LOG_VERBOSE() << "Presents on " << target.connector->getName() << ": " << frames << " frames, " << missed << " missed vblanks, "
+                      << "submit to scanout avg/max us " << (totalLatency.count() / static_cast<long>(frames)) << "/" << longestLatency.count()
+                      << ", vblank period " << std::chrono::duration_cast<std::chrono::microseconds>(target.chain->getRefreshPeriod()).count() << " us" << std::endl;
+    }
+
+    static void destroyPipelines() {
+        for (auto& target : pipelines) {
+            target->framebuffer.reset();
+            display::manager::destroySwapChain(target->chain);
+            target->pool.stop();
+
+            // Tiles are keyed by font pointers, so they must not outlive the fonts
+            for (tileCache& cache : target->tiles) {
+                cache.clear();
+            }
+        }
+        pipelines.clear();
+    }
+
+    /*
+    Builds a pipeline for every active display, rebuilding all of them whenever the display configuration changed since.
+    The render threads are split evenly between the displays, the pipeline pool runs one pipeline per thread.
+    */
+    static bool syncPipelines(const config::RenderSettings& renderSettings, size_t renderThreads) {
+        if (!pipelines.empty() && pipelineGeneration == display::manager::configurationGeneration.load()) {
+            return true;
+        }
+
+        destroyPipelines();
+
+        const size_t displayCount = display::manager::activeDisplays.size();
+        const size_t threadsPerPipeline = std::max<size_t>(1, renderThreads / std::max<size_t>(1, displayCount));
+
+        for (const auto& [connectorId, connector] : display::manager::activeDisplays) {
+            // The buffers have to match the mode the CRTC scans out, which may not be the preferred one
+            std::shared_ptr<display::crtc> crtc = display::manager::findCrtc(connector);
+            display::mode displayMode = crtc && crtc->getCurrentMode().getWidth() > 0 ? crtc->getCurrentMode() : connector->getPreferredMode();
+
+            // Frames are drawn into a back buffer while the front one is scanned out, so nothing half drawn reaches the screen
+            std::shared_ptr<display::swapChain> chain = display::manager::createSwapChain(
+                connector,
+                displayMode.getWidth(),
+                displayMode.getHeight(),
+                static_cast<size_t>(std::max(0, renderSettings.swapChainLength))
+            );
+
+            if (!chain) {
+                LOG_ERROR() << "Failed to create swap chain for " << connector->getName() << std::endl;
+                continue;
+            }
+
+            // Headless frames aren't shown anywhere, capturing them is the only way to check what was drawn
+            if (display::manager::isHeadless()) {
+                config::DisplaySettings displaySettings = config::manager::getConfigCopy().display;
+                capture::mode captureMode = capture::parseMode(displaySettings.captureMode);
+                if (captureMode != capture::mode::NONE) {
+                    chain->setCaptureSink(std::make_shared<capture::sink>(captureMode, displaySettings.capturePath, chain->getCrtcId(), displaySettings.captureRingLength));
+                }
+            }
+
+            auto target = std::make_unique<pipeline>();
+            target->connector = connector;
+            target->chain = chain;
+            target->tiles.assign(threadsPerPipeline, tileCache(maxCachedTiles));
+            target->bandTimings.assign(threadsPerPipeline * bandsPerThread, bandTiming{});
+            target->pool.start(threadsPerPipeline);
+
+            pipelines.push_back(std::move(target));
+        }
+
+        pipelinePool.start(pipelines.size());
+
+        // Creating the swap chains may have changed the configuration itself, that must not trigger another rebuild
+        pipelineGeneration = display::manager::configurationGeneration.load();
+
+        // Nothing drawn before is in the new buffers
+        window::manager::handles.concurrent([](window::handleStore& self){
+            for (auto& handle : self) {
+                std::lock_guard<std::mutex> lock(handle.cellBufferMutex);
+                handle.presented.invalidate();
+            }
+        });
+
+        return !pipelines.empty();
+    }
+
+    // The cells of handles drawn later which the last renderHandle call painted over no longer show what their shadow copy says.
+    // They are marked stale, so those handles redraw them on top again within the same frame.
+    static void invalidateOverdrawn(pipeline& target, size_t lowerIndex) {
+        for (size_t upperIndex = lowerIndex + 1; upperIndex < target.handles.size(); upperIndex++) {
+            window::handle& upper = *target.handles[upperIndex];
+            cellPlacement above = placementOf(upper);
+            if (above.columns <= 0 || above.rows <= 0 || above.cellWidth <= 0 || above.cellHeight <= 0) {
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(upper.cellBufferMutex);
+
+            window::presentedState& presented = upper.presented;
+            if (!presented.valid || presented.cells.size() != static_cast<size_t>(above.columns) * static_cast<size_t>(above.rows)) {
+                continue;   // Everything is redrawn anyway
+            }
+
+            for (const types::rectangle& rect : target.handleDamage) {
+                // Cells of the upper handle the rectangle touches at all
+                int left = rect.position.x - above.origin.x;
+                int top = rect.position.y - above.origin.y;
+
+                int firstX = std::clamp(divideDown(left, above.cellWidth), 0, above.columns);
+                int endX = std::clamp(divideUp(left + rect.size.x, above.cellWidth), firstX, above.columns);
+                int firstY = std::clamp(divideDown(top, above.cellHeight), 0, above.rows);
+                int endY = std::clamp(divideUp(top + rect.size.y, above.cellHeight), firstY, above.rows);
+
+                if (firstX == endX || firstY == endY) {
+                    continue;
+                }
+
+                for (int y = firstY; y < endY; y++) {
+                    for (int x = firstX; x < endX; x++) {
+                        presented.invalidate(static_cast<size_t>(y) * above.columns + x);
+                    }
+                }
+                upper.changedRows.include(firstY, endY);
+            }
+        }
+    }
+
+    // Clears and renders the handles of one display into its back buffer, runs concurrently with the other pipelines
+    static void drawPipeline(pipeline& target) {
+        if (!target.framebuffer) {
+            return;
+        }
+
+        // First clear handles that need to be cleared
+        bool clearedAny = false;
+        for (window::handle* handle : target.handles) {
+            if (clearOccupiedArea(target, handle)) {
+                clearedAny = true;
+            }
+        }
+
+        // A cleared area may have wiped cells of overlapping neighbours, so their shadow copies are no longer what is on screen.
+        // Handles on other displays are in other buffers and keep theirs.
+        if (clearedAny) {
+            target.needsPresent = true;
+            for (window::handle* handle : target.handles) {
+                std::lock_guard<std::mutex> lock(handle->cellBufferMutex);
+                handle->presented.invalidate();
+            }
+        }
+
+        // After clearing area, then render the handles, only changed cells are redrawn.
+        for (size_t index = 0; index < target.handles.size(); index++) {
+            if (renderHandle(target, target.handles[index])) {
+                target.needsPresent = true;
+                invalidateOverdrawn(target, index);
+            }
+        }
+    }
+
     // Initialize display and font systems
     void init() {
         // Initialize display system
@@ -208,46 +974,38 @@ namespace renderer {
             return;
         }
         
-        // Use the first available display
-        primaryConnector = availableDisplays[0];
-        if (!primaryConnector->isConnected()) {
-            LOG_ERROR() << "Primary display is not connected" << std::endl;
-            return;
-        }
-        
-        // Get preferred mode
-        auto modes = primaryConnector->getAvailableModes();
-        if (modes.empty()) {
-            LOG_ERROR() << "No available modes for primary display" << std::endl;
-            return;
+        // Every connected display shows its own part of the desktop, each gets its own pipeline
+        std::vector<std::shared_ptr<display::connector>> connectedDisplays;
+        for (const auto& connector : availableDisplays) {
+            if (connector->isConnected() && !connector->getAvailableModes().empty()) {
+                connectedDisplays.push_back(connector);
+            }
         }
-        
-        currentMode = std::make_unique<display::mode>(primaryConnector->getPreferredMode());
-        
-        // Enable the display
-        if (!display::manager::enableDisplay(primaryConnector, *currentMode)) {
-            LOG_ERROR() << "Failed to enable primary display" << std::endl;
+
+        if (connectedDisplays.empty()) {
+            LOG_ERROR() << "No connected display with available modes" << std::endl;
             return;
         }
-        
-        // Create framebuffer
-        currentFramebuffer = display::manager::createFramebuffer(
-            currentMode->getWidth(), 
-            currentMode->getHeight(), 
-            0x34325258  // DRM_FORMAT_XRGB8888
-        );
-        
-        if (!currentFramebuffer) {
-            LOG_ERROR() << "Failed to create framebuffer" << std::endl;
+
+        // Displays that fail to come up are left dark, the others are still used
+        display::manager::setupExtendedDisplays(connectedDisplays);
+        if (display::manager::activeDisplays.empty()) {
+            LOG_ERROR() << "Failed to enable any display" << std::endl;
             return;
         }
         
-        // Map the framebuffer for CPU access
-        if (!currentFramebuffer->map()) {
-            LOG_ERROR() << "Failed to map framebuffer" << std::endl;
+        config::RenderSettings renderSettings = config::manager::getRenderSettings();
+
+        size_t renderThreads = renderSettings.renderThreads > 0 ? static_cast<size_t>(renderSettings.renderThreads) : std::max(1u, std::thread::hardware_concurrency());
+        parallelThresholdCells = static_cast<size_t>(std::max(0, renderSettings.parallelThresholdCells));
+
+        if (!syncPipelines(renderSettings, renderThreads)) {
+            LOG_ERROR() << "Failed to create swap chain" << std::endl;
             return;
         }
-        
+
+        LOG_VERBOSE() << "Renderer using " << renderThreads << " thread(s) over " << pipelines.size() << " display(s), windows from " << parallelThresholdCells << " cells up are rendered in parallel" << std::endl;
+
         rendererInitialized = true;
         
         // Load wallpaper if configured
@@ -255,41 +1013,119 @@ namespace renderer {
         if (!wallpaperPath.empty()) {
             config::manager::loadWallpaper(wallpaperPath);
         }
+
+        // Frames are only rendered when something happened, and are timed to the vblanks of the displays. The configured
+        // cap applies on top, the refresh rate only stands in while there are no vblank timestamps to go by.
+        // Slower displays are held back by their own swap chain, which only hands out a buffer once a flip completed.
+        if (renderSettings.maxFramesPerSecond > 0) {
+            minFrameInterval = std::chrono::nanoseconds(1000000000LL / renderSettings.maxFramesPerSecond);
+        }
+
+        int maxRefreshRate = 0;
+        for (const auto& target : pipelines) {
+            maxRefreshRate = std::max(maxRefreshRate, static_cast<int>(target->connector->getPreferredMode().getRefreshRate()));
+        }
+        if (maxRefreshRate > 0) {
+            refreshFrameInterval = std::chrono::nanoseconds(1000000000LL / maxRefreshRate);
+        }
+
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd < 0) {
+            LOG_ERROR() << "Failed to create renderer wake eventfd: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        // The renderer sleeps on the same reactor as the GGUI sockets, the wake eventfd and DRM events are level triggered
+        window::manager::connections.watch(wakeFd, false);
+        window::manager::connections.watch(display::manager::getEventFd(), false);
         
         // Start rendering thread
-        std::thread renderingThread([](){
+        std::thread renderingThread([renderSettings, renderThreads](){
             size_t frameCounter = 0;
             auto lastLogTime = std::chrono::high_resolution_clock::now();
+            auto lastFrameStart = std::chrono::steady_clock::time_point{};
             size_t framesRendered = 0;
             size_t totalFrames = 0;
+
+            // Descriptors reported by the reactor during the last wait, sorted
+            std::vector<int> readyFds;
             
             while (!shouldExit) {
-                bool needsPresent = false;
-                auto frameStart = std::chrono::high_resolution_clock::now();
-                
-                window::manager::handles([&needsPresent](std::vector<window::handle>& self){
+                // Start just in time for the next vblank, the first frame after idling is only delayed if that vblank is far enough away
+                auto frameStart = scheduleFrameStart(lastFrameStart);
+                if (std::chrono::steady_clock::now() < frameStart) {
+                    std::this_thread::sleep_until(frameStart);
+                }
+                lastFrameStart = std::chrono::steady_clock::now();
+
+                bool pendingWork = false;
+
+                // Completed page flips free up their previous front buffer
+                display::manager::processEvents(0);  // Non-blocking call
+
+                // Displays coming and going rebuild the pipelines, the layout follows through the same generation
+                syncPipelines(renderSettings, renderThreads);
+
+                // Frames a busy CRTC turned down are flipped before anything else, their buffer may be the only one left to draw into
+                for (auto& target : pipelines) {
+                    display::manager::retryFlip(target->chain);
+                }
+
+                // While every buffer of a display is on screen or waiting for a flip, handles are still polled but drawing on it waits
+                // for the next flip completion of its CRTC, which wakes this thread. Changed rows and stains pile up until then.
+                for (auto& target : pipelines) {
+                    target->framebuffer = target->chain->acquire();
+                    target->damage.clear();
+                    target->handles.clear();
+                    target->needsPresent = false;
+                }
+
+                // Changing the list itself needs it exclusively, which is kept short so input and handshakes aren't held up
+                window::manager::handles([](window::handleStore& self){
+                    window::manager::adoptArrivals(self);
+
                     // First we'll need to order the handles, so that rendering order is correct, where lower z's get drawn first to be overdrawn.
-                    std::sort(self.begin(), self.end(), [](const window::handle& a, const window::handle& b) {
+                    // Only the draw order of ids is sorted, and only when it's out of order, the handles themselves never move.
+                    self.sort([](const window::handle& a, const window::handle& b) {
                         types::rectangle aRectangle = a.getCellCoordinates();
                         types::rectangle bRectangle = b.getCellCoordinates();
                         return aRectangle.position.z < bRectangle.position.z;  // Sort by z position
                     });
+                });
 
+                // Polling and rendering only touch the handles themselves, cell buffers are guarded by their own mutexes
+                window::manager::handles.concurrent([&pendingWork, &readyFds](window::handleStore& self){
                     // Receive cell buffers and check for disconnected handles
                     for (int i = static_cast<int>(self.size()) - 1; i >= 0; i--) {
-                        // Poll active handles for new data
+                        if (std::binary_search(readyFds.begin(), readyFds.end(), self[i].connection.getHandle())) {
+                            self[i].connection.markReadable();
+                        }
+
+                        // Poll active handles for new data, handles without new data return without touching their socket
                         self[i].poll();
                     }
+                    readyFds.clear();
+
+                    // Cells hidden behind other windows are neither rendered nor decoded
+                    updateCoverage(self);
 
-                    // Render gotten cell buffers.
+                    // Each handle is only drawn into the buffer of the display it is on, keeping the draw order
                     for (auto& handle : self) {
-                        // First clear handles that need to be cleared
-                        if (clearOccupiedArea(&handle)) {
-                            needsPresent = true;
+                        if (pipeline* target = pipelineOf(handle)) {
+                            target->handles.push_back(&handle);
                         }
-                        // After clearing area, then render the handle, this is for resized handles 
-                        if (renderHandle(&handle)) {
-                            needsPresent = true;
+                    }
+
+                    // Pipelines write to their own buffers, damage and tile caches only, so displays are drawn concurrently
+                    pipelinePool.run(pipelines.size(), [](size_t index, size_t){
+                        drawPipeline(*pipelines[index]);
+                    });
+
+                    // Stains, dead handles and sockets with more queued data are resolved on the following frame. The reactor is
+                    // edge triggered, so it won't report sockets which still hold data from before the wait.
+                    for (auto& handle : self) {
+                        if (handle.dirty != window::stain::type::clear || handle.connection.isClosed() || handle.connection.isReadable()) {
+                            pendingWork = true;
                         }
                     }
                 });
@@ -297,14 +1133,21 @@ namespace renderer {
                 // Clean up dead handles after polling
                 window::manager::cleanupDeadHandles();
 
-                // Process DRM events to handle page flip completions
-                // This prevents memory accumulation in the DRM page flip queue
-                display::manager::processEvents(0);  // Non-blocking call
+                // Present each back buffer only once per frame if anything was rendered on it, the flip happens on the next vblank of its CRTC without waiting for it
+                bool presentedAny = false;
+                for (auto& target : pipelines) {
+                    if (target->needsPresent && target->framebuffer) {
+                        display::manager::present(target->chain, target->damage);
+                        presentedAny = true;
+                    }
+                }
 
-                // Present the framebuffer only once per frame if anything was rendered
-                if (needsPresent && currentFramebuffer) {
-                    display::manager::present(primaryConnector, currentFramebuffer);
+                if (presentedAny) {
                     framesRendered++;
+
+                    // Follows slower frames right away, but only gives the time back gradually
+                    auto spent = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - lastFrameStart);
+                    frameBudget = std::max(spent, frameBudget - frameBudget / 16);
                 }
                 
                 totalFrames++;
@@ -319,28 +1162,46 @@ namespace renderer {
                     LOG_VERBOSE() << "Renderer stats: " << avgFPS << " FPS, " 
                                   << renderRate << " rendered FPS, " 
                                   << ((renderRate / avgFPS) * 100.0f) << "% utilization" << std::endl;
+
+                    tileCacheStats tiles = getTileCacheStats();
+                    LOG_VERBOSE() << "Tile cache: " << tiles.hits << " hits, " << tiles.misses << " misses, "
+                                  << tiles.evictions << " evictions, " << tiles.size << "/" << tiles.capacity << " tiles" << std::endl;
+
+                    for (auto& target : pipelines) {
+                        logPresentTimings(*target);
+                    }
+
+                    for (auto& target : pipelines) {
+                        std::vector<bandTiming>& bandTimings = target->bandTimings;
+                        if (bandTimings.empty() || bandTimings[0].samples == 0) {
+                            continue;
+                        }
+
+                        std::stringstream bandLog;
+                        for (size_t band = 0; band < bandTimings.size(); band++) {
+                            const bandTiming& timing = bandTimings[band];
+                            if (timing.samples == 0) {
+                                continue;
+                            }
+                            bandLog << " [" << band << "] " << (timing.total.count() / static_cast<long>(timing.samples)) << "/" << timing.longest.count();
+                        }
+                        LOG_VERBOSE() << "Band timings of " << target->connector->getName() << " avg/max us over " << target->pool.size() << " threads:" << bandLog.str() << std::endl;
+
+                        bandTimings.assign(bandTimings.size(), bandTiming{});
+                    }
                     
                     lastLogTime = now;
                     framesRendered = 0;
                     totalFrames = 0;
                 }
 
-                // Adaptive timing: only sleep if we didn't do much work
-                auto frameEnd = std::chrono::high_resolution_clock::now();
-                auto frameTime = std::chrono::duration_cast<std::chrono::milliseconds>(frameEnd - frameStart);
-                
-                if (needsPresent) {
-                    // If we rendered something, aim for higher FPS (60 FPS = ~16ms)
-                    const auto targetFrameTime = std::chrono::milliseconds(16);
-                    if (frameTime < targetFrameTime) {
-                        std::this_thread::sleep_for(targetFrameTime - frameTime);
-                    }
-                } else {
-                    // If nothing was rendered, sleep longer to reduce CPU usage (10 FPS = ~960ms)
-                    const auto idleFrameTime = std::chrono::milliseconds(16 * 60);
-                    if (frameTime < idleFrameTime) {
-                        std::this_thread::sleep_for(idleFrameTime - frameTime);
-                    }
+                // Sleep until a client sends data, a page flip completes or someone calls wake(), idling costs no CPU time.
+                // Flips turned down by a busy CRTC get no event to wake up for, those are retried on a timer instead.
+                if (!pendingWork && !shouldExit) {
+                    bool retryingFlips = std::any_of(pipelines.begin(), pipelines.end(), [](const std::unique_ptr<pipeline>& target) {
+                        return target->chain->needsFlipRetry();
+                    });
+                    waitForWork(readyFds, retryingFlips ? flipRetryIntervalMs : -1);
                 }
             }
             LOG_VERBOSE() << "Renderer thread exiting..." << std::endl;
@@ -352,24 +1213,106 @@ namespace renderer {
     void exit() {
         LOG_VERBOSE() << "Shutting down renderer..." << std::endl;
         shouldExit = true;  // Signal renderer thread to exit
+        wake();             // The renderer thread may be idling in waitForWork
         
-        // Give the thread more time to exit gracefully
-        // The renderer thread sleeps for up to 33ms per iteration, so we need at least that much time
+        // Give the thread time to finish the frame it may still be in
         std::this_thread::sleep_for(std::chrono::milliseconds(200));
         
-        if (currentFramebuffer) {
-            currentFramebuffer->unmap();
-            currentFramebuffer.reset();
-        }
-        
+        // Tiles are keyed by font pointers, so they go along with the pipelines before the fonts do
+        destroyPipelines();
+        pipelinePool.stop();
+
         font::manager::cleanup();
         display::manager::cleanup();
         rendererInitialized = false;
+
+        if (wakeFd >= 0) {
+            close(wakeFd);
+            wakeFd = -1;
+        }
         
         LOG_VERBOSE() << "Renderer shutdown complete." << std::endl;
     }
 
-    bool renderHandle(const window::handle* handle) {
+    // Renders the changed cells on rows [rowBegin, rowEnd). Bands write to disjoint framebuffer rows and shadow cells, so they can run concurrently.
+    static void renderBand(const bandJob& job, int rowBegin, int rowEnd, size_t worker, bandResult& result) {
+        const window::handle* handle = job.handle;
+        window::presentedState& presented = handle->presented;
+        tileCache& tiles = job.tiles[worker];
+
+        result.damage.clear();
+        result.renderedCells = 0;
+
+        // Render each cell using cell coordinates for iteration
+        for (int cellY = rowBegin; cellY < rowEnd; cellY++) {
+            int firstDirtyX = -1;   // Span of changed cells on this row, used for damage reporting
+            int lastDirtyX = -1;
+
+            for (int cellX = 0; cellX < job.cellRect.size.x; cellX++) {
+                int cellIndex = cellY * job.cellRect.size.x + cellX;
+                
+                // Bounds check for cell buffer access
+                if (cellIndex < 0 || static_cast<size_t>(cellIndex) >= handle->cellBuffer->size()) {
+                    LOG_ERROR() << "Cell index out of bounds: " << cellIndex << " (buffer size: " << handle->cellBuffer->size() << ")" << std::endl;
+                    continue;
+                }
+                
+                const types::Cell& cell = (*handle->cellBuffer)[cellIndex];
+                
+                // Calculate pixel position in framebuffer using pixel coordinates
+                int pixelX = job.pixelRect.position.x + cellX * job.cellWidth;
+                int pixelY = job.pixelRect.position.y + cellY * job.cellHeight;
+                
+                // Skip if out of bounds
+                if (pixelX >= job.maxX || pixelY >= job.maxY) {
+                    continue;
+                }
+
+                // Skip cells which are hidden behind other windows or already on screen as-is
+                if (handle->visibility.isHidden(cellIndex)) {
+                    continue;
+                }
+                if (!job.fullRedraw && presented.cells[cellIndex] == cell && !presented.isStale(cellIndex)) {
+                    continue;
+                }
+
+                // Look the tile up from the persistent cache, only rendering it through the font on a miss
+                bool fresh = false;
+                cellTile& tile = tiles.acquire({cell, handle->zoom, job.cellFont, job.cellWidth, job.cellHeight}, fresh);
+                if (fresh) {
+                    tile.render(cell, job.cellFont, job.cellWidth, job.cellHeight, handle->zoom);
+                }
+                
+                // Memory operation batching - fast framebuffer blitting
+                blitCellToFramebuffer(job.fbBuffer, job.fbStride, job.fbHeight, pixelX, pixelY, tile);
+                presented.cells[cellIndex] = cell;
+                if (!presented.stale.empty()) {
+                    presented.stale[cellIndex] = 0;
+                }
+
+                if (firstDirtyX < 0) {
+                    firstDirtyX = cellX;
+                }
+                lastDirtyX = cellX;
+
+                result.renderedCells++;
+            }
+
+            if (firstDirtyX >= 0) {
+                int damageX = job.pixelRect.position.x + firstDirtyX * job.cellWidth;
+                int damageY = job.pixelRect.position.y + cellY * job.cellHeight;
+                int damageWidth = std::min((lastDirtyX + 1 - firstDirtyX) * job.cellWidth, job.maxX - damageX);
+                int damageHeight = std::min(job.cellHeight, job.maxY - damageY);
+
+                addDamage(result.damage, {{damageX, damageY}, {damageWidth, damageHeight}});
+            }
+        }
+    }
+
+    static bool renderHandle(pipeline& target, const window::handle* handle) {
+        target.handleDamage.clear();
+
+        const std::shared_ptr<display::frameBuffer>& currentFramebuffer = target.framebuffer;
         if (!rendererInitialized || !handle || !currentFramebuffer || handle->connection.isClosed()) {
             return false;
         }
@@ -439,75 +1382,126 @@ namespace renderer {
         // LOG_VERBOSE() << "Framebuffer bounds: " << currentFramebuffer->getWidth() << "x" << currentFramebuffer->getHeight() 
         //               << ", Window bounds: " << maxX << "x" << maxY << std::endl;
         
-        bool didRender = false;
-        int renderedCells = 0;
+        // Nothing of it would end up on screen, updateCoverage invalidates the shadow copy once some of it shows again
+        if (handle->visibility.full()) {
+            handle->changedRows.clear();
+            return false;
+        }
 
-        auto font = handle->getFont();
+        // Compare against what was drawn last time, any change in geometry or zoom forces every cell to be redrawn.
+        window::presentedState& presented = handle->presented;
+        const bool fullRedraw = !presented.valid || 
+                                presented.zoom != handle->zoom || 
+                                presented.pixelArea != windowPixelRect || 
+                                presented.cells.size() != handle->cellBuffer->size();
 
-        // Optimized cell cache using pre-converted XRGB8888 format (non-static to avoid sharing issues)
-        OptimizedCellCache cellCache;
-        cellCache.initialize(cellWidth, cellHeight);
-        
-        // Temporary buffer for font rendering (only used on cache miss)
-        font::cellRenderData tempRenderBuffer{
+        const int rows = windowCellRect.size.y;
+
+        // Only rows poll has written to can differ from the shadow copy, unless everything is redrawn anyway
+        int firstRow = 0;
+        int lastRow = rows;
+
+        if (fullRedraw) {
+            presented.cells.assign(handle->cellBuffer->size(), types::Cell{});
+            presented.stale.clear();
+            presented.pixelArea = windowPixelRect;
+            presented.zoom = handle->zoom;
+        }
+        else {
+            if (handle->changedRows.empty()) {
+                return false;
+            }
+
+            firstRow = std::clamp(handle->changedRows.begin, 0, rows);
+            lastRow = std::clamp(handle->changedRows.end, firstRow, rows);
+        }
+
+        handle->changedRows.clear();
+
+        bandJob job{
+            handle,
+            handle->getFont(),
+            target.tiles.data(),
+            fbBuffer,
+            static_cast<int>(currentFramebuffer->getPitch() / sizeof(uint32_t)),
+            static_cast<int>(currentFramebuffer->getHeight()),
+            windowCellRect,
+            windowPixelRect,
             cellWidth,
             cellHeight,
-            {}
+            maxX,
+            maxY,
+            fullRedraw
         };
-        tempRenderBuffer.pixels.resize(tempRenderBuffer.width * tempRenderBuffer.height);
-        
-        // Render each cell using cell coordinates for iteration
-        for (int cellY = 0; cellY < windowCellRect.size.y; cellY++) {
-            for (int cellX = 0; cellX < windowCellRect.size.x; cellX++) {
-                int cellIndex = cellY * windowCellRect.size.x + cellX;
-                
-                // Bounds check for cell buffer access
-                if (cellIndex < 0 || static_cast<size_t>(cellIndex) >= handle->cellBuffer->size()) {
-                    LOG_ERROR() << "Cell index out of bounds: " << cellIndex << " (buffer size: " << handle->cellBuffer->size() << ")" << std::endl;
-                    continue;
-                }
-                
-                const types::Cell& cell = (*handle->cellBuffer)[cellIndex];
-                
-                // Calculate pixel position in framebuffer using pixel coordinates
-                int pixelX = windowPixelRect.position.x + cellX * cellWidth;
-                int pixelY = windowPixelRect.position.y + cellY * cellHeight;
-                
-                // Skip if out of bounds
-                if (pixelX >= maxX || pixelY >= maxY) {
-                    continue;
+
+        const int changedRowCount = lastRow - firstRow;
+        bool didRender = false;
+
+        // Small windows and small updates aren't worth waking the other threads for
+        bandPool& renderPool = target.pool;
+        std::vector<bandResult>& bandResults = target.bandResults;
+
+        if (renderPool.size() == 1 || static_cast<size_t>(changedRowCount) * windowCellRect.size.x < parallelThresholdCells || changedRowCount < 2) {
+            bandResult& result = bandResults.empty() ? bandResults.emplace_back() : bandResults[0];
+            renderBand(job, firstRow, lastRow, 0, result);
+
+            target.handleDamage.insert(target.handleDamage.end(), result.damage.begin(), result.damage.end());
+            didRender = result.renderedCells > 0;
+        }
+        else {
+            const size_t bandCount = std::min(static_cast<size_t>(changedRowCount), renderPool.size() * bandsPerThread);
+            if (bandResults.size() < bandCount) {
+                bandResults.resize(bandCount);
+            }
+
+            renderPool.run(bandCount, [&job, &bandResults, &firstRow, &changedRowCount, &bandCount](size_t band, size_t worker) {
+                auto bandStart = std::chrono::high_resolution_clock::now();
+
+                int rowBegin = firstRow + static_cast<int>(changedRowCount * band / bandCount);
+                int rowEnd = firstRow + static_cast<int>(changedRowCount * (band + 1) / bandCount);
+                renderBand(job, rowBegin, rowEnd, worker, bandResults[band]);
+
+                bandResults[band].duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - bandStart);
+            });
+
+            // Bands are merged in row order, which keeps adjacent damage mergeable
+            for (size_t band = 0; band < bandCount; band++) {
+                const bandResult& result = bandResults[band];
+                for (const types::rectangle& rect : result.damage) {
+                    addDamage(target.handleDamage, rect);
                 }
+                didRender |= result.renderedCells > 0;
 
-                // Smart fingerprint-based lookup - O(1) cell comparison
-                if (!cellCache.isValid || cellCache.cellID != cell) {
-                    // Cache miss - need to render cell
-                    std::fill(tempRenderBuffer.pixels.begin(), tempRenderBuffer.pixels.end(), cell.backgroundColor);
-                    
-                    if (font) {
-                        tempRenderBuffer = font->renderCell(cell, tempRenderBuffer, handle->zoom);
-                    }
-                    
-                    // Format pre-conversion - convert RGB to XRGB8888 during caching
-                    cellCache.convertFromRGB(tempRenderBuffer);
-                    cellCache.cellID = cell;
+                if (band < target.bandTimings.size()) {
+                    bandTiming& timing = target.bandTimings[band];
+                    timing.total += result.duration;
+                    timing.longest = std::max(timing.longest, result.duration);
+                    timing.samples++;
                 }
-                
-                // Memory operation batching - fast framebuffer blitting
-                blitCellToFramebuffer(fbBuffer, currentFramebuffer->getPitch() / sizeof(uint32_t), 
-                                    currentFramebuffer->getHeight(), pixelX, pixelY, cellCache);
-                didRender = true;
-                renderedCells++;
             }
         }
-        
-        // LOG_VERBOSE() << "Rendered " << renderedCells << " cells out of " << handle->cellBuffer->size() << std::endl;
+
+        presented.valid = true;
+
+        for (const types::rectangle& rect : target.handleDamage) {
+            addDamage(target.damage, rect);
+        }
         
         return didRender;
     }
+
+    bool renderHandle(const window::handle* handle) {
+        if (!handle) {
+            return false;
+        }
+
+        pipeline* target = pipelineOf(*handle);
+        return target ? renderHandle(*target, handle) : false;
+    }
     
     void renderCellToFramebuffer(uint32_t* fbBuffer, int fbWidth, int fbHeight, int startX, int startY, const font::cellRenderData& cellData) {
-        // Legacy function - kept for backward compatibility
-        // For better performance, use the optimized caching system in renderHandle()
+        // Legacy function - kept for backward compatibility with the RGB cellRenderData path
+        // New code should render straight into XRGB8888 with font::font::renderCell(cell, pixels, width, height, stride, zoom)
         
         // Bounds checking
         if (startX >= fbWidth || startY >= fbHeight) {
@@ -6,9 +6,23 @@
 #include "font.h"
 
 namespace renderer {
+    // Counters of the persistent cell tile cache, reported in the renderer stats log.
+    struct tileCacheStats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t size = 0;
+        size_t capacity = 0;
+    };
+
     extern void init();    // Sets up the rendering thread, which polls data from the handles and transform them into a renderable format for DRM.
     extern bool renderHandle(const window::handle* handle);  // Returns true if rendering occurred
     extern void exit();
+
+    // Wakes the renderer thread out of its idle wait, call after changing anything which affects what is on screen.
+    extern void wake();
+
+    extern tileCacheStats getTileCacheStats();
     
     // Helper function to render cell data to framebuffer
     extern void renderCellToFramebuffer(uint32_t* fbBuffer, int fbWidth, int fbHeight,
@@ -0,0 +1,128 @@
+#ifndef _SLOTMAP_H_
+#define _SLOTMAP_H_
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cassert>
+
+namespace slot {
+    /*
+    Identifies an element of a slot::map. The generation counts how often the slot has been reused,
+    so an id of a removed element never resolves to whatever took its slot later on.
+    */
+    struct id {
+        uint32_t index = 0;
+        uint32_t generation = 0;    // Zero is never handed out, so a default constructed id is always invalid
+
+        bool valid() const { return generation != 0; }
+
+        bool operator==(const id& other) const { return index == other.index && generation == other.generation; }
+        bool operator!=(const id& other) const { return !(*this == other); }
+    };
+
+    /*
+    Stores elements behind stable ids with O(1) insertion, lookup and removal.
+    Elements live on the heap and never move, so references to them stay valid until they are removed.
+    */
+    template<typename T>
+    class map {
+        struct entry {
+            std::unique_ptr<T> value;
+            uint32_t generation = 1;
+        };
+
+        std::vector<entry> entries;
+        std::vector<uint32_t> freeIndices;
+        size_t count = 0;
+    public:
+        /**
+         * @brief Constructs a new element in a free slot.
+         *
+         * @return The id of the new element
+         */
+        template<typename... Args>
+        id emplace(Args&&... args) {
+            uint32_t index;
+            if (!freeIndices.empty()) {
+                index = freeIndices.back();
+                freeIndices.pop_back();
+            }
+            else {
+                index = static_cast<uint32_t>(entries.size());
+                entries.emplace_back();
+            }
+
+            entries[index].value = std::make_unique<T>(std::forward<Args>(args)...);
+            count++;
+
+            return {index, entries[index].generation};
+        }
+
+        /**
+         * @brief Destroys the element, its id won't resolve to anything from now on.
+         *
+         * @return true if the id referred to a live element, false otherwise
+         */
+        bool erase(id target) {
+            T* element = get(target);
+            if (!element) {
+                return false;
+            }
+
+            entry& slotEntry = entries[target.index];
+            slotEntry.value.reset();
+
+            // Skip zero on wrap around, it marks invalid ids
+            if (++slotEntry.generation == 0) {
+                slotEntry.generation = 1;
+            }
+
+            freeIndices.push_back(target.index);
+            count--;
+            return true;
+        }
+
+        /**
+         * @brief Resolves an id.
+         *
+         * @return The element, or nullptr if it has been removed or the id was never valid
+         */
+        T* get(id target) const {
+            if (target.index >= entries.size()) {
+                return nullptr;
+            }
+
+            const entry& slotEntry = entries[target.index];
+            if (slotEntry.generation != target.generation) {
+                return nullptr;
+            }
+            return slotEntry.value.get();
+        }
+
+        /**
+         * @brief Resolves an id the caller knows to be live, such as one taken from its own list of ids.
+         *
+         * @return The element, asserted rather than checked in release builds
+         */
+        T& at(id target) const {
+            assert(get(target) && "slot::map::at with a removed or invalid id");
+            return *entries[target.index].value;
+        }
+
+        bool contains(id target) const { return get(target) != nullptr; }
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        void clear() {
+            for (uint32_t index = 0; index < entries.size(); index++) {
+                if (entries[index].value) {
+                    erase({index, entries[index].generation});
+                }
+            }
+        }
+    };
+}
+
+#endif
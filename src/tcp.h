@@ -5,6 +5,11 @@
 #include <cstdint>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -16,6 +21,9 @@
 #include <errno.h>
 #include <iostream>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <poll.h>
 
 #include "types.h"
 #include "logger.h"
@@ -28,6 +36,10 @@ namespace packet {
         INPUT,          // Fer sending/receiving input data
         NOTIFY,         // Contains an notify flag sending like empty buffers, for optimized polling.
         RESIZE,         // For sending/receiving GGUI resize
+        DRAW_DELTA,     // For sending only the changed spans of cells, see packet::delta
+        DRAW_ENCODED,   // For sending all cells in the compact encoding, see packet::encoded
+        SHARED_SETUP,   // Hands over a shared memory ring with SCM_RIGHTS, see packet::shared
+        SHARED_DOORBELL,// Tells that a slot of the shared memory ring holds a new frame
     };
 
     class base {
@@ -42,6 +54,8 @@ namespace packet {
             UNKNOWN         = 0 << 0,
             EMPTY_BUFFER    = 1 << 0,
             CLOSED          = 1 << 1,   // When GGUI client has shutdown
+            ENCODED_BUFFERS = 1 << 2,   // Sent by GGDirect when it accepts DRAW_ENCODED packets
+            SHARED_MEMORY   = 1 << 3,   // Sent by GGDirect to local clients when it accepts SHARED_SETUP packets
         };
 
         class base : public packet::base {
@@ -101,6 +115,162 @@ namespace packet {
 
     // Computes at compile time the maximum needed buffer length for a packet.
     constexpr int size = sizeof(maxSizetype);
+
+    /*
+    Every packet after the handshake travels in a frame: a fixed header followed by exactly payloadLength bytes.
+    DRAW_BUFFER payloads are the raw cells, every other type carries its packet struct padded to packet::size.
+    Since the length is always explicit, a receiver can skip frames it doesn't want without losing its place in the stream.
+    */
+    namespace frame {
+        constexpr uint16_t version = 1;
+
+        // Anything above this can't be a sane cell grid, so the stream is considered corrupt instead of trying to skip it
+        constexpr uint32_t maxPayloadLength = 64u * 1024u * 1024u;
+
+        struct header {
+            uint16_t packetType;        // packet::type
+            uint16_t version;           // frame::version of the sender
+            uint32_t sequence;          // Counts up by one per frame sent on the connection
+            uint32_t payloadLength;     // Bytes following this header
+        };
+
+        static_assert(sizeof(header) == 12, "Frame header layout is part of the wire protocol");
+    }
+
+    /*
+    A DRAW_DELTA payload is a list of spans, each followed directly by its cells. Offsets index the window's cell grid row by row,
+    so a span may wrap onto following rows. Deltas only apply on top of a full DRAW_BUFFER of the same window size.
+    */
+    namespace delta {
+        struct span {
+            uint32_t offset;    // Index of the first cell
+            uint32_t count;     // Cells following this span header
+        };
+
+        static_assert(sizeof(span) == 8, "Delta span layout is part of the wire protocol");
+    }
+
+    /*
+    A DRAW_ENCODED payload holds the same full cell grid as DRAW_BUFFER, but compact: a palette of the colors in use followed by runs of
+    identical cells, so the long stretches of blank cells terminal screens consist of shrink to a single run each.
+    Layout: header, paletteSize RGB triples, then runs until the end of the payload.
+    */
+    namespace encoded {
+        constexpr uint32_t maxPaletteSize = 256;    // Runs index colors with a byte, clients with more colors send DRAW_BUFFER instead
+
+        struct header {
+            uint32_t cellCount;     // Must match the window size, like the length of a DRAW_BUFFER
+            uint32_t paletteSize;
+        };
+
+        struct run {
+            char utf[4];
+            uint16_t count;             // Repeats of this cell, at least one
+            uint8_t textColor;          // Palette index
+            uint8_t backgroundColor;    // Palette index
+        };
+
+        static_assert(sizeof(header) == 8 && sizeof(run) == 8, "Encoded cell layout is part of the wire protocol");
+        static_assert(sizeof(types::RGB) == 3, "Palette entries are packed RGB triples");
+
+        // Cell count the payload was encoded for, 0 if the payload is too short to tell
+        inline uint32_t cellCountOf(const char* payload, size_t length) {
+            header encodedHeader{};
+            if (length < sizeof(encodedHeader)) {
+                return 0;
+            }
+            memcpy(&encodedHeader, payload, sizeof(encodedHeader));
+            return encodedHeader.cellCount;
+        }
+
+        /**
+         * @brief Expands an encoded payload into cells.
+         * 
+         * @param payload The DRAW_ENCODED payload
+         * @param length Bytes in the payload
+         * @param cells Where to write the cells, partially written if decoding fails
+         * @param cellCount Number of cells expected
+         * @return true if the payload was well formed and covered exactly cellCount cells
+         */
+        inline bool decode(const char* payload, size_t length, types::Cell* cells, size_t cellCount) {
+            header encodedHeader{};
+            if (length < sizeof(encodedHeader)) {
+                return false;
+            }
+            memcpy(&encodedHeader, payload, sizeof(encodedHeader));
+
+            if (encodedHeader.cellCount != cellCount || encodedHeader.paletteSize > maxPaletteSize) {
+                return false;
+            }
+
+            size_t position = sizeof(encodedHeader);
+            size_t paletteBytes = encodedHeader.paletteSize * sizeof(types::RGB);
+            if (length - position < paletteBytes || (length - position - paletteBytes) % sizeof(run) != 0) {
+                return false;
+            }
+
+            types::RGB palette[maxPaletteSize];
+            memcpy(palette, payload + position, paletteBytes);
+            position += paletteBytes;
+
+            size_t written = 0;
+            for (; position < length; position += sizeof(run)) {
+                run current;
+                memcpy(&current, payload + position, sizeof(current));
+
+                if (current.count == 0 || current.count > cellCount - written ||
+                    current.textColor >= encodedHeader.paletteSize || current.backgroundColor >= encodedHeader.paletteSize) {
+                    return false;
+                }
+
+                types::Cell cell;
+                memcpy(cell.utf, current.utf, sizeof(cell.utf));
+                cell.textColor = palette[current.textColor];
+                cell.backgroundColor = palette[current.backgroundColor];
+
+                std::fill_n(cells + written, current.count, cell);
+                written += current.count;
+            }
+
+            return written == cellCount;
+        }
+    }
+    /*
+    Local clients can skip the socket for cells altogether: they create a sealed memfd holding a ring of slots, pass it over the unix socket
+    with a SHARED_SETUP frame and from then on write cell grids straight into the slots. Only a small SHARED_DOORBELL frame crosses the socket per frame.
+    */
+    namespace shared {
+        constexpr uint32_t maxSlotCount = 8;
+
+        // Slot states, the client only writes FREE slots and GGDirect only reads READY ones
+        enum class state : uint32_t {
+            FREE,
+            READY
+        };
+
+        struct setup {
+            uint32_t slotCount;
+            uint32_t slotSize;      // Bytes of cells each slot can hold
+        };
+
+        // Start of each slot, the cells follow right after it
+        struct slotHeader {
+            std::atomic<uint32_t> state;    // shared::state, set to READY with release semantics after the cells are written
+            uint32_t cellCount;
+        };
+
+        struct doorbell {
+            uint32_t slot;
+        };
+
+        static_assert(sizeof(slotHeader) == 8, "Slot layout is part of the wire protocol");
+        static_assert(std::atomic<uint32_t>::is_always_lock_free, "Slot state is shared between processes");
+
+        // Distance between slots, kept on cache line boundaries so neighbouring slots don't share lines
+        constexpr size_t slotStride(uint32_t slotSize) {
+            return (sizeof(slotHeader) + slotSize + 63) & ~static_cast<size_t>(63);
+        }
+    }
 }
 
 namespace tcp {
@@ -112,7 +282,61 @@ namespace tcp {
      */
     class connection {
         int handle;
+        std::atomic<bool> shutDown{false};  // Set by shutdown(), the descriptor stays valid until close()
+        bool readable = true;   // Edge triggered readiness from a reactor, cleared once the socket has been read dry
+        std::atomic<uint32_t> sendSequence{0};  // Sequence number of the next outgoing frame, frames are sent from several threads
+        std::mutex sendMutex;                   // Held for a whole frame by SendFrame
+
+        // Internal buffer for packet reception to handle partial reads
+        std::vector<char> packetBuffer;
+        size_t packetBytesReceived = 0;
+
+        // Descriptors passed by the peer with SCM_RIGHTS, owned until taken
+        std::vector<int> receivedFds;
+        constexpr static size_t maxReceivedFds = 4;
+
+        // Receives like recv, but keeps descriptors passed along with the bytes instead of letting the kernel drop them
+        ssize_t receiveWithDescriptors(char* data, size_t length) {
+            iovec segment{data, length};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)];
+
+            msghdr message{};
+            message.msg_iov = &segment;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            ssize_t recvd = recvmsg(handle, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+
+            if (recvd > 0) {
+                for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+                    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+                        continue;
+                    }
+
+                    size_t fdCount = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    for (size_t i = 0; i < fdCount; i++) {
+                        int fd;
+                        memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(fd));
+
+                        // Nobody needs more than a few at once, don't let a peer pile up descriptors in our process
+                        if (receivedFds.size() >= maxReceivedFds) {
+                            ::close(fd);
+                            continue;
+                        }
+                        receivedFds.push_back(fd);
+                    }
+                }
+            }
+
+            return recvd;
+        }
     public:
+        /**
+         * @brief Default constructor that creates a closed connection, to be assigned or moved into later.
+         */
+        connection() : handle(-1) {}
+
         /**
          * @brief Constructs a connection from an existing socket file descriptor.
          * 
@@ -135,7 +359,7 @@ namespace tcp {
         }
 
         bool isClosed() const {
-            return handle < 0;
+            return handle < 0 || shutDown.load(std::memory_order_acquire);
         }
 
         // Disable copy constructor and assignment operator to prevent double-close
@@ -143,19 +367,44 @@ namespace tcp {
         connection& operator=(const connection&) = delete;
 
         // Enable move constructor and assignment operator
-        connection(connection&& other) noexcept : handle(other.handle) {
+        connection(connection&& other) noexcept 
+            : handle(other.handle), shutDown(other.shutDown.load()), readable(other.readable), sendSequence(other.sendSequence.load()),
+              packetBuffer(std::move(other.packetBuffer)), packetBytesReceived(other.packetBytesReceived),
+              receivedFds(std::move(other.receivedFds)) {
             other.handle = -1;
+            other.packetBytesReceived = 0;
+            other.receivedFds.clear();
         }
 
         connection& operator=(connection&& other) noexcept {
             if (this != &other) {
                 close();
                 handle = other.handle;
+                shutDown = other.shutDown.load();
+                readable = other.readable;
+                sendSequence = other.sendSequence.load();
+                packetBuffer = std::move(other.packetBuffer);
+                packetBytesReceived = other.packetBytesReceived;
+                receivedFds = std::move(other.receivedFds);
                 other.handle = -1;
+                other.packetBytesReceived = 0;
+                other.receivedFds.clear();
             }
             return *this;
         }
 
+        /**
+         * @brief Marks the socket as having new data, called when a reactor reports it readable.
+         */
+        void markReadable() { readable = true; }
+
+        /**
+         * @brief Checks whether the socket may still have unread data since the last reactor notification.
+         * 
+         * @return false once a read has hit EAGAIN, until the reactor reports new data
+         */
+        bool isReadable() const { return readable && !isClosed(); }
+
         /**
          * @brief Sends typed data over the TCP connection.
          * 
@@ -258,53 +507,59 @@ namespace tcp {
         }
 
         /**
-         * @brief Checks if data is available for reading without blocking.
+         * @brief Reports how a non-blocking connect ended, once the socket has become writable.
          * 
-         * @return true if data is available, false otherwise
+         * @return 0 if the connection was established, otherwise the errno value it failed with
          */
-        bool hasDataAvailable() {
+        int getPendingError() const {
             if (handle < 0) {
-                return false;
+                return EBADF;
             }
-            
-            fd_set readfds;
-            FD_ZERO(&readfds);
-            FD_SET(handle, &readfds);
 
-            struct timeval timeout = {0, 0}; // immediate return
-            int sel = select(handle + 1, &readfds, nullptr, nullptr, &timeout);
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(handle, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+                return errno;
+            }
+            return error;
+        }
 
-            if (sel <= 0) {
-                // -1 = error, 0 = no readiness
+        /**
+         * @brief Checks if data is available for reading without blocking.
+         * 
+         * The socket is expected to be watched by a tcp::reactor, which marks it readable when data arrives.
+         * Until then this returns false without touching the socket at all.
+         * 
+         * @return true if data is available, false otherwise
+         */
+        bool hasDataAvailable() {
+            if (isClosed() || !readable) {
                 return false;
             }
 
-            if (FD_ISSET(handle, &readfds)) {
-                char dummy;
-                ssize_t result = recv(handle, &dummy, 1, MSG_PEEK | MSG_DONTWAIT);
+            char dummy;
+            ssize_t result = recv(handle, &dummy, 1, MSG_PEEK | MSG_DONTWAIT);
 
-                if (result > 0) {
-                    // Data is available
-                    return true;
-                } else if (result == 0) {
-                    // Connection closed by peer
-                    LOG_VERBOSE() << "Connection closed by peer" << std::endl;
-                    close();
+            if (result > 0) {
+                // Data is available
+                return true;
+            } else if (result == 0) {
+                // Connection closed by peer
+                LOG_VERBOSE() << "Connection closed by peer" << std::endl;
+                shutdown();
+                return false;
+            } else {
+                if (errno == EWOULDBLOCK) {  // EAGAIN is same value
+                    // Read dry, wait for the reactor to report new data
+                    readable = false;
                     return false;
                 } else {
-                    if (errno == EWOULDBLOCK) {  // EAGAIN is same value
-                        // No data available right now
-                        return false;
-                    } else {
-                        // Some other error occurred, assume connection is bad
-                        LOG_ERROR() << "Socket error in hasDataAvailable: " << strerror(errno) << std::endl;
-                        close();
-                        return false;
-                    }
+                    // Some other error occurred, assume connection is bad
+                    LOG_ERROR() << "Socket error in hasDataAvailable: " << strerror(errno) << std::endl;
+                    shutdown();
+                    return false;
                 }
             }
-
-            return false;
         }
 
         /**
@@ -317,7 +572,7 @@ namespace tcp {
          */
         template<typename T>
         bool ReceiveNonBlocking(T* data, size_t count = 1) {
-            if (handle < 0) {
+            if (isClosed() || !readable) {
                 return false;
             }
             if (!data && count > 0) {
@@ -330,17 +585,12 @@ namespace tcp {
             
             // Keep receiving until we have all the data or would block
             while (bytesReceived < totalBytes) {
-                // Check if more data is available before each read
-                if (!hasDataAvailable()) {
-                    // No more data available right now
-                    return false;
-                }
-                
                 ssize_t recvd = recv(handle, buffer + bytesReceived, totalBytes - bytesReceived, MSG_DONTWAIT);
                 
                 if (recvd < 0) {
                     if (errno == EWOULDBLOCK) {
                         // Would block, return false to indicate no complete data available
+                        readable = false;
                         return false;
                     }
                     // Other error
@@ -357,12 +607,96 @@ namespace tcp {
             return bytesReceived == totalBytes;
         }
 
-    private:
-        // Internal buffer for packet reception to handle partial reads
-        std::vector<char> packetBuffer;
-        size_t packetBytesReceived = 0;
-        
-    public:
+        /**
+         * @brief Copies the next bytes from the socket without consuming them.
+         * 
+         * @tparam T The type of data to peek
+         * @param data Pointer to the buffer where the peeked data will be stored
+         * @param count Number of elements of type T to peek
+         * @return true if the whole count is already queued, false otherwise
+         */
+        template<typename T>
+        bool PeekNonBlocking(T* data, size_t count = 1) {
+            if (isClosed() || !readable) {
+                return false;
+            }
+
+            size_t totalBytes = count * sizeof(T);
+            ssize_t peeked = recv(handle, data, totalBytes, MSG_PEEK | MSG_DONTWAIT);
+
+            if (peeked == 0) {
+                // Connection closed by peer
+                LOG_VERBOSE() << "Connection closed by peer" << std::endl;
+                shutdown();
+                return false;
+            }
+            if (peeked < 0) {
+                if (errno == EWOULDBLOCK) {
+                    readable = false;
+                } else {
+                    LOG_ERROR() << "Socket error while peeking: " << strerror(errno) << std::endl;
+                    shutdown();
+                }
+                return false;
+            }
+
+            return peeked == static_cast<ssize_t>(totalBytes);
+        }
+
+        /**
+         * @brief Non-blocking receive which scatters the incoming bytes over several buffers, in order.
+         * 
+         * Lets a packet header and its payload land in separate buffers, without staging them in one and copying.
+         * 
+         * @param segments Buffers to fill, advanced in place as data arrives
+         * @param segmentCount Number of buffers
+         * @return true if every buffer was completely filled, false otherwise
+         */
+        bool ReceiveScatteredNonBlocking(iovec* segments, size_t segmentCount) {
+            if (isClosed() || !readable) {
+                return false;
+            }
+
+            size_t current = 0;
+            while (current < segmentCount) {
+                if (segments[current].iov_len == 0) {
+                    current++;
+                    continue;
+                }
+
+                msghdr message{};
+                message.msg_iov = segments + current;
+                message.msg_iovlen = segmentCount - current;
+
+                ssize_t recvd = recvmsg(handle, &message, MSG_DONTWAIT);
+                if (recvd < 0) {
+                    if (errno == EWOULDBLOCK) {
+                        readable = false;
+                    }
+                    return false;
+                }
+                if (recvd == 0) {
+                    // Connection closed by peer
+                    return false;
+                }
+
+                // Advance past what was filled
+                size_t remaining = static_cast<size_t>(recvd);
+                while (remaining > 0 && current < segmentCount) {
+                    size_t taken = std::min(remaining, segments[current].iov_len);
+                    segments[current].iov_base = static_cast<char*>(segments[current].iov_base) + taken;
+                    segments[current].iov_len -= taken;
+                    remaining -= taken;
+
+                    if (segments[current].iov_len == 0) {
+                        current++;
+                    }
+                }
+            }
+
+            return true;
+        }
+
         /**
          * @brief Attempt to receive a complete packet using internal buffering.
          * 
@@ -376,7 +710,7 @@ namespace tcp {
          */
         template<typename T>
         bool ReceivePacketNonBlocking(T* data, size_t count = 1) {
-            if (handle < 0) {
+            if (isClosed()) {
                 return false;
             }
             if (!data && count > 0) {
@@ -391,32 +725,34 @@ namespace tcp {
                 packetBytesReceived = 0;
             }
             
+            if (!readable) {
+                return false; // Nothing new since the socket was last read dry
+            }
+            
             // Keep reading until we have a complete packet
             while (packetBytesReceived < packetSize) {
-                // Check if data is available
-                if (!hasDataAvailable()) {
-                    return false; // No more data available right now
-                }
-                
-                ssize_t recvd = recv(
-                    handle, 
+                ssize_t recvd = receiveWithDescriptors(
                     packetBuffer.data() + packetBytesReceived, 
-                    packetSize - packetBytesReceived, 
-                    MSG_DONTWAIT
+                    packetSize - packetBytesReceived
                 );
                 
                 if (recvd < 0) {
                     if (errno == EWOULDBLOCK) {
                         // Would block, but we might have partial data
+                        readable = false;
                         return false;
                     }
                     // Other error - reset buffer
+                    LOG_ERROR() << "Socket error while receiving packet: " << strerror(errno) << std::endl;
                     packetBytesReceived = 0;
+                    shutdown();
                     return false;
                 }
                 if (recvd == 0) {
                     // Connection closed by peer - reset buffer
+                    LOG_VERBOSE() << "Connection closed by peer" << std::endl;
                     packetBytesReceived = 0;
+                    shutdown();
                     return false;
                 }
                 
@@ -432,18 +768,424 @@ namespace tcp {
             return true;
         }
 
+        /**
+         * @brief Receives whatever part of a buffer is already queued, for callers which track their own progress.
+         * 
+         * @param data Where to continue writing
+         * @param length Bytes still missing
+         * @return Bytes received, 0 if nothing is queued right now and -1 once the connection has been closed
+         */
+        ssize_t ReceiveAvailableNonBlocking(char* data, size_t length) {
+            if (isClosed()) {
+                return -1;
+            }
+            if (!readable || length == 0) {
+                return 0;
+            }
+
+            size_t bytesReceived = 0;
+            while (bytesReceived < length) {
+                ssize_t recvd = receiveWithDescriptors(data + bytesReceived, length - bytesReceived);
+
+                if (recvd < 0) {
+                    if (errno == EWOULDBLOCK) {
+                        readable = false;
+                        break;
+                    }
+                    LOG_ERROR() << "Socket error while receiving: " << strerror(errno) << std::endl;
+                    shutdown();
+                    return -1;
+                }
+                if (recvd == 0) {
+                    LOG_VERBOSE() << "Connection closed by peer" << std::endl;
+                    shutdown();
+                    return -1;
+                }
+
+                bytesReceived += recvd;
+            }
+
+            return static_cast<ssize_t>(bytesReceived);
+        }
+
+        /**
+         * @brief Sends a framed packet, see packet::frame.
+         * 
+         * Senders are serialized per connection, so frames sent from different threads never interleave even when the
+         * non-blocking socket only takes part of one at a time. If a frame can't be sent completely after part of it
+         * went out, the connection is shut down, since the peer could never find the start of the next frame again.
+         * 
+         * @param type The packet type of the payload
+         * @param payload The payload bytes
+         * @param length Number of payload bytes
+         * @return true if the whole frame was sent, false otherwise
+         */
+        bool SendFrame(packet::type type, const void* payload, uint32_t length) {
+            if (!payload && length > 0) {
+                return false;
+            }
+
+            std::lock_guard<std::mutex> lock(sendMutex);
+            if (isClosed()) {
+                return false;
+            }
+
+            // Read under the lock, so sequence numbers go out in order. It's only used up once part of the frame is on
+            // the wire, a frame which never started isn't counted by the peer as skipped.
+            packet::frame::header frameHeader{
+                static_cast<uint16_t>(type),
+                packet::frame::version,
+                sendSequence.load(),
+                length
+            };
+
+            iovec segments[] = {
+                {&frameHeader, sizeof(frameHeader)},
+                {const_cast<void*>(payload), length}
+            };
+            size_t current = 0;
+            bool started = false;   // Whether any byte of the frame is on the wire
+
+            while (current < 2) {
+                msghdr message{};
+                message.msg_iov = segments + current;
+                message.msg_iovlen = 2 - current;
+
+                ssize_t sent = sendmsg(handle, &message, MSG_NOSIGNAL);
+                if (sent < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+
+                    if (errno == EWOULDBLOCK) {
+                        // The socket is non-blocking, give a slow reader a moment instead of tearing the frame apart
+                        pollfd writable{handle, POLLOUT, 0};
+                        int ready = ::poll(&writable, 1, 100);
+                        if (ready > 0 || (ready < 0 && errno == EINTR)) {
+                            continue;
+                        }
+                    }
+
+                    if (started) {
+                        LOG_ERROR() << "Failed to send the rest of a " << length << " byte frame, dropping connection" << std::endl;
+                        shutdown();
+                    }
+                    return false;
+                }
+
+                if (sent > 0 && !started) {
+                    sendSequence.store(frameHeader.sequence + 1);
+                    started = true;
+                }
+
+                // Advance past what was sent
+                size_t remaining = static_cast<size_t>(sent);
+                while (remaining > 0 && current < 2) {
+                    size_t taken = std::min(remaining, segments[current].iov_len);
+                    segments[current].iov_base = static_cast<char*>(segments[current].iov_base) + taken;
+                    segments[current].iov_len -= taken;
+                    remaining -= taken;
+
+                    if (segments[current].iov_len == 0) {
+                        current++;
+                    }
+                }
+                while (current < 2 && segments[current].iov_len == 0) {
+                    current++;
+                }
+            }
+
+            return true;
+        }
+
+        /**
+         * @brief Ends the connection without giving up the descriptor.
+         * 
+         * The peer sees the connection end and every further send or receive fails, but the descriptor number stays
+         * taken until close(). Use this where other threads may still be using the connection, a closed descriptor
+         * could be reused by the next accepted socket and receive what was meant for this one.
+         */
+        void shutdown() {
+            if (handle >= 0 && !shutDown.exchange(true, std::memory_order_acq_rel)) {
+                ::shutdown(handle, SHUT_RDWR);
+            }
+        }
+
         /**
          * @brief Closes the TCP connection.
          * 
          * This method closes the underlying socket and marks the connection as invalid.
-         * It's safe to call this method multiple times.
+         * It's safe to call this method multiple times, but only where no other thread can reach the connection.
          */
         void close() {
             if (handle >= 0) {
                 ::close(handle);
                 handle = -1; // Mark as closed
             }
+
+            for (int fd : receivedFds) {
+                ::close(fd);
+            }
+            receivedFds.clear();
+        }
+
+        /**
+         * @brief Takes ownership of the oldest descriptor the peer passed with SCM_RIGHTS.
+         * 
+         * @return The descriptor, or -1 if none has been received
+         */
+        int takeReceivedFd() {
+            if (receivedFds.empty()) {
+                return -1;
+            }
+
+            int fd = receivedFds.front();
+            receivedFds.erase(receivedFds.begin());
+            return fd;
+        }
+
+        /**
+         * @brief Checks whether this is a unix domain socket, which can pass descriptors and shared memory.
+         * 
+         * @return true if the connection is local, false otherwise
+         */
+        bool isLocal() const {
+            if (handle < 0) {
+                return false;
+            }
+
+            int domain = 0;
+            socklen_t length = sizeof(domain);
+            return getsockopt(handle, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 && domain == AF_UNIX;
+        }
+    };
+
+    /**
+     * @brief Shared memory ring handed over by a local client, see packet::shared.
+     * 
+     * The client owns the contents, so everything read from it is validated before use.
+     */
+    class sharedRing {
+        char* base = nullptr;
+        size_t mappedSize = 0;
+        uint32_t slotCount = 0;
+        uint32_t slotSize = 0;
+    public:
+        sharedRing() = default;
+
+        ~sharedRing() {
+            unmap();
+        }
+
+        sharedRing(const sharedRing&) = delete;
+        sharedRing& operator=(const sharedRing&) = delete;
+
+        sharedRing(sharedRing&& other) noexcept 
+            : base(other.base), mappedSize(other.mappedSize), slotCount(other.slotCount), slotSize(other.slotSize) {
+            other.base = nullptr;
+            other.mappedSize = 0;
+        }
+
+        sharedRing& operator=(sharedRing&& other) noexcept {
+            if (this != &other) {
+                unmap();
+                base = other.base;
+                mappedSize = other.mappedSize;
+                slotCount = other.slotCount;
+                slotSize = other.slotSize;
+                other.base = nullptr;
+                other.mappedSize = 0;
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Maps the ring described by a SHARED_SETUP frame.
+         * 
+         * The memfd has to be sealed against shrinking, otherwise the client could truncate it and fault us on the next read.
+         * 
+         * @param fd The memfd passed by the client, always closed by this call
+         * @param layout Slot layout announced by the client
+         * @return true if the ring was mapped, false otherwise
+         */
+        bool map(int fd, const packet::shared::setup& layout) {
+            unmap();
+
+            if (layout.slotCount == 0 || layout.slotCount > packet::shared::maxSlotCount || layout.slotSize == 0 || layout.slotSize > packet::frame::maxPayloadLength) {
+                LOG_ERROR() << "Rejected shared memory ring of " << layout.slotCount << " slots of " << layout.slotSize << " bytes" << std::endl;
+                ::close(fd);
+                return false;
+            }
+
+            int seals = fcntl(fd, F_GET_SEALS);
+            if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+                LOG_ERROR() << "Rejected shared memory ring which isn't sealed against shrinking" << std::endl;
+                ::close(fd);
+                return false;
+            }
+
+            size_t requiredSize = packet::shared::slotStride(layout.slotSize) * layout.slotCount;
+            struct stat status{};
+            if (fstat(fd, &status) < 0 || static_cast<size_t>(status.st_size) < requiredSize) {
+                LOG_ERROR() << "Shared memory ring is smaller than its " << requiredSize << " byte layout" << std::endl;
+                ::close(fd);
+                return false;
+            }
+
+            void* mapping = mmap(nullptr, requiredSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);    // The mapping keeps the memory alive
+
+            if (mapping == MAP_FAILED) {
+                LOG_ERROR() << "Failed to map shared memory ring: " << strerror(errno) << std::endl;
+                return false;
+            }
+
+            base = static_cast<char*>(mapping);
+            mappedSize = requiredSize;
+            slotCount = layout.slotCount;
+            slotSize = layout.slotSize;
+            return true;
+        }
+
+        void unmap() {
+            if (base) {
+                munmap(base, mappedSize);
+                base = nullptr;
+                mappedSize = 0;
+            }
+        }
+
+        bool isMapped() const { return base != nullptr; }
+
+        /**
+         * @brief Copies the cells of a READY slot and hands the slot back to the client.
+         * 
+         * @param slot Index of the slot from the doorbell
+         * @param cells Where to copy the cells
+         * @param cellCount Number of cells the window currently holds
+         * @return true if the slot held exactly cellCount cells, false if it was empty, malformed or made for another size
+         */
+        bool consume(uint32_t slot, types::Cell* cells, size_t cellCount) {
+            if (!base || slot >= slotCount) {
+                return false;
+            }
+
+            char* slotStart = base + packet::shared::slotStride(slotSize) * slot;
+            packet::shared::slotHeader* header = reinterpret_cast<packet::shared::slotHeader*>(slotStart);
+
+            if (header->state.load(std::memory_order_acquire) != static_cast<uint32_t>(packet::shared::state::READY)) {
+                return false;
+            }
+
+            // Read the count once, the client may scribble over it at any time
+            uint32_t slotCells = header->cellCount;
+            bool matches = slotCells == cellCount && cellCount * sizeof(types::Cell) <= slotSize;
+
+            if (matches) {
+                memcpy(cells, slotStart + sizeof(packet::shared::slotHeader), cellCount * sizeof(types::Cell));
+            }
+
+            header->state.store(static_cast<uint32_t>(packet::shared::state::FREE), std::memory_order_release);
+            return matches;
+        }
+    };
+
+    /**
+     * @brief Resumable parser for the framed protocol, see packet::frame.
+     * 
+     * Keeps its place in the stream across polls, so a frame may arrive in any number of pieces. Once a header is in,
+     * the caller decides where the payload goes through setPayloadTarget, which lets payloads land straight in their
+     * final buffer.
+     */
+    class frameReader {
+    public:
+        enum class status {
+            PENDING,    // Waiting for more bytes
+            HEADER,     // A header was just read, call setPayloadTarget before reading on
+            COMPLETE,   // The current frame has been read completely
+            BROKEN      // The stream can't be followed anymore, the connection has been closed
+        };
+
+        /**
+         * @brief Reads as much of the current frame as is queued.
+         * 
+         * @param conn The connection to read from
+         * @return What happened, see status
+         */
+        status read(connection& conn) {
+            if (!haveHeader) {
+                if (!conn.ReceivePacketNonBlocking(&current)) {
+                    return conn.isClosed() ? status::BROKEN : status::PENDING;
+                }
+
+                if (current.version != packet::frame::version) {
+                    LOG_ERROR() << "Frame version " << current.version << " isn't supported, expected " << packet::frame::version << std::endl;
+                    conn.shutdown();
+                    return status::BROKEN;
+                }
+
+                if (current.payloadLength > packet::frame::maxPayloadLength) {
+                    LOG_ERROR() << "Frame payload of " << current.payloadLength << " bytes exceeds the protocol limit, dropping connection" << std::endl;
+                    conn.shutdown();
+                    return status::BROKEN;
+                }
+
+                // Gaps in the sequence mean the client skipped frames on its side
+                if (sequenceKnown && current.sequence != expectedSequence) {
+                    skippedFrames += current.sequence - expectedSequence;
+                }
+                expectedSequence = current.sequence + 1;
+                sequenceKnown = true;
+
+                haveHeader = true;
+                payload = nullptr;
+                payloadReceived = 0;
+                return status::HEADER;
+            }
+
+            if (payloadReceived < current.payloadLength) {
+                if (!payload) {
+                    LOG_ERROR() << "No payload target for a frame of " << current.payloadLength << " bytes" << std::endl;
+                    conn.shutdown();
+                    return status::BROKEN;
+                }
+
+                ssize_t recvd = conn.ReceiveAvailableNonBlocking(payload + payloadReceived, current.payloadLength - payloadReceived);
+                if (recvd < 0) {
+                    return status::BROKEN;
+                }
+                payloadReceived += static_cast<size_t>(recvd);
+
+                if (payloadReceived < current.payloadLength) {
+                    return status::PENDING;
+                }
+            }
+
+            haveHeader = false;
+            return status::COMPLETE;
         }
+
+        // Where the payload of the current frame goes, must hold at least header().payloadLength bytes
+        void setPayloadTarget(void* target) { payload = static_cast<char*>(target); }
+
+        // Whether a header has been read but its payload hasn't been completely yet
+        bool inFrame() const { return haveHeader; }
+
+        // The header of the frame being read, or of the last completed one
+        const packet::frame::header& header() const { return current; }
+
+        // Frames the peer numbered but never sent, useful for spotting a client which can't keep up
+        uint64_t getSkippedFrames() const { return skippedFrames; }
+
+    private:
+        packet::frame::header current{};
+        bool haveHeader = false;
+        char* payload = nullptr;
+        size_t payloadReceived = 0;
+
+        uint32_t expectedSequence = 0;
+        bool sequenceKnown = false;
+        uint64_t skippedFrames = 0;
     };
 
     /**
@@ -454,6 +1196,7 @@ namespace tcp {
      */
     class listener {
         int handle;
+        std::string socketPath;     // Set for unix domain listeners, whose socket file is removed again on close
     public:
         /**
          * @brief Default constructor that creates an uninitialized listener.
@@ -504,6 +1247,45 @@ namespace tcp {
             }
         }
 
+        /**
+         * @brief Constructs a unix domain listener for local clients on the given path.
+         * 
+         * Local clients skip the TCP stack and can pass shared memory over the connection, see packet::shared.
+         * 
+         * @param path Filesystem path of the socket, replaced if it already exists
+         * @throws std::runtime_error if socket creation, binding, or listening fails
+         */
+        explicit listener(const std::string& path) : handle(-1) {
+            sockaddr_un addr{};
+            if (path.size() >= sizeof(addr.sun_path)) {
+                throw std::runtime_error("Socket path too long: " + path);
+            }
+
+            handle = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (handle < 0) {
+                throw std::runtime_error("Failed to create socket: " + std::string(strerror(errno)));
+            }
+
+            // A previous instance may have left its socket file behind
+            unlink(path.c_str());
+
+            addr.sun_family = AF_UNIX;
+            memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+            if (bind(handle, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+                ::close(handle);
+                throw std::runtime_error("Failed to bind socket to " + path + ": " + std::string(strerror(errno)));
+            }
+
+            if (listen(handle, 5) < 0) {
+                ::close(handle);
+                unlink(path.c_str());
+                throw std::runtime_error("Failed to start listening on socket: " + std::string(strerror(errno)));
+            }
+
+            socketPath = path;
+        }
+
         /**
          * @brief Destructor that properly closes the listener socket.
          */
@@ -511,6 +1293,9 @@ namespace tcp {
             if (handle >= 0) {
                 ::close(handle);
             }
+            if (!socketPath.empty()) {
+                unlink(socketPath.c_str());
+            }
         }
 
         // Disable copy constructor and assignment operator to prevent double-close
@@ -518,8 +1303,9 @@ namespace tcp {
         listener& operator=(const listener&) = delete;
 
         // Enable move constructor and assignment operator
-        listener(listener&& other) noexcept : handle(other.handle) {
+        listener(listener&& other) noexcept : handle(other.handle), socketPath(std::move(other.socketPath)) {
             other.handle = -1;
+            other.socketPath.clear();
         }
 
         listener& operator=(listener&& other) noexcept {
@@ -527,8 +1313,13 @@ namespace tcp {
                 if (handle >= 0) {
                     ::close(handle);
                 }
+                if (!socketPath.empty()) {
+                    unlink(socketPath.c_str());
+                }
                 handle = other.handle;
+                socketPath = std::move(other.socketPath);
                 other.handle = -1;
+                other.socketPath.clear();
             }
             return *this;
         }
@@ -551,15 +1342,43 @@ namespace tcp {
                 throw std::runtime_error("Failed to accept connection: " + std::string(strerror(errno)));
             }
             
-            // Enable TCP_NODELAY for lower latency on accepted connections
+            // Enable TCP_NODELAY for lower latency on accepted connections, unix sockets don't batch to begin with
             int nodelay = 1;
-            if (setsockopt(connFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
+            if (socketPath.empty() && setsockopt(connFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
                 LOG_ERROR() << "Warning: Failed to enable TCP_NODELAY on accepted connection: " << strerror(errno) << std::endl;
             }
             
             return connection(connFd);
         }
 
+        /**
+         * @brief Accepts a pending connection without blocking, for listeners watched by a tcp::reactor.
+         * 
+         * @param accepted Receives the non-blocking connection
+         * @return true if a connection was accepted, false if none was pending or accepting failed
+         */
+        bool TryAccept(connection& accepted) {
+            if (handle < 0) {
+                return false;
+            }
+
+            int connFd = accept4(handle, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (connFd < 0) {
+                if (errno != EWOULDBLOCK && errno != EINTR) {
+                    LOG_ERROR() << "Failed to accept connection: " << strerror(errno) << std::endl;
+                }
+                return false;
+            }
+
+            int nodelay = 1;
+            if (socketPath.empty() && setsockopt(connFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
+                LOG_ERROR() << "Warning: Failed to enable TCP_NODELAY on accepted connection: " << strerror(errno) << std::endl;
+            }
+
+            accepted = connection(connFd);
+            return true;
+        }
+
         /**
          * @brief Gets the port number this listener is bound to.
          * 
@@ -657,6 +1476,153 @@ namespace tcp {
             
             return connection(sockFd);
         }
+
+        /**
+         * @brief Starts a non-blocking connection to the specified host and port.
+         * 
+         * The connection is usable once the socket becomes writable and connection::getPendingError returns 0.
+         * 
+         * @param port The port number to connect to
+         * @param host The IP address to connect to (defaults to localhost)
+         * @return A non-blocking connection object, which may still be connecting
+         * @throws std::runtime_error if socket creation, address parsing, or starting the connection fails
+         */
+        static connection beginConnection(uint16_t port, const char* host = "127.0.0.1") {
+            if (!host) {
+                throw std::invalid_argument("Host cannot be null");
+            }
+
+            int sockFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (sockFd < 0) {
+                throw std::runtime_error("Failed to create socket: " + std::string(strerror(errno)));
+            }
+
+            int nodelay = 1;
+            if (setsockopt(sockFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
+                LOG_ERROR() << "Warning: Failed to enable TCP_NODELAY: " << strerror(errno) << std::endl;
+            }
+
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+
+            if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+                ::close(sockFd);
+                throw std::runtime_error("Invalid IP address format: " + std::string(host));
+            }
+
+            if (connect(sockFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+                ::close(sockFd);
+                throw std::runtime_error("Failed to connect to " + std::string(host) + ":" + 
+                                       std::to_string(port) + " - " + std::string(strerror(errno)));
+            }
+
+            return connection(sockFd);
+        }
+    };
+
+    /**
+     * @brief epoll based readiness notifier for many sockets.
+     * 
+     * Connections are watched edge triggered: the reactor only reports a socket when new data arrives, after which
+     * the connection is marked readable until a read hits EAGAIN. This replaces polling every socket on every frame.
+     * Other descriptors, like eventfds, can be watched level triggered alongside them.
+     */
+    class reactor {
+        int epollFd;
+        std::vector<epoll_event> events;
+    public:
+        /**
+         * @brief Creates the epoll instance, failures are logged and leave the reactor invalid.
+         */
+        reactor() : epollFd(epoll_create1(EPOLL_CLOEXEC)), events(64) {
+            if (epollFd < 0) {
+                LOG_ERROR() << "Failed to create epoll instance: " << strerror(errno) << std::endl;
+            }
+        }
+
+        ~reactor() {
+            if (epollFd >= 0) {
+                ::close(epollFd);
+            }
+        }
+
+        // Disable copy constructor and assignment operator to prevent double-close
+        reactor(const reactor&) = delete;
+        reactor& operator=(const reactor&) = delete;
+
+        bool isValid() const { return epollFd >= 0; }
+
+        /**
+         * @brief Starts watching a file descriptor for readability.
+         * 
+         * @param fd The descriptor to watch
+         * @param edgeTriggered Only report new data instead of every wait while data is pending
+         * @param writable Watch for writability instead, like a non-blocking connect finishing
+         * @return true if the descriptor was added, false otherwise
+         */
+        bool watch(int fd, bool edgeTriggered, bool writable = false) {
+            if (epollFd < 0 || fd < 0) {
+                return false;
+            }
+
+            epoll_event event{};
+            event.events = (writable ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | (edgeTriggered ? EPOLLET : 0u);
+            event.data.fd = fd;
+
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+                LOG_ERROR() << "Failed to watch fd " << fd << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Starts watching a connection, edge triggered.
+         * 
+         * The connection starts out readable, so anything which arrived before this call is not missed.
+         */
+        bool watch(connection& conn) {
+            conn.markReadable();
+            return watch(conn.getHandle(), true);
+        }
+
+        /**
+         * @brief Stops watching a file descriptor. Closed descriptors are removed by the kernel on their own.
+         */
+        void unwatch(int fd) {
+            if (epollFd >= 0 && fd >= 0) {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            }
+        }
+
+        /**
+         * @brief Waits for watched descriptors to become readable.
+         * 
+         * @param readyFds Receives the descriptors which became readable, it is cleared first
+         * @param timeoutMs Timeout in milliseconds, -1 waits until something happens
+         * @return The number of ready descriptors, 0 on timeout or interruption and -1 on failure
+         */
+        int wait(std::vector<int>& readyFds, int timeoutMs = -1) {
+            readyFds.clear();
+            if (epollFd < 0) {
+                return -1;
+            }
+
+            int count = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), timeoutMs);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    return 0;
+                }
+                LOG_ERROR() << "epoll_wait failed: " << strerror(errno) << std::endl;
+                return -1;
+            }
+
+            for (int i = 0; i < count; i++) {
+                readyFds.push_back(events[i].data.fd);
+            }
+            return count;
+        }
     };
 }
 
@@ -158,6 +158,14 @@ namespace types {
     inline bool operator!=(const Cell& a, const Cell& b) {
         return !(a == b);
     }
+
+    inline bool operator==(const rectangle& a, const rectangle& b) {
+        return a.position == b.position && a.size == b.size;
+    }
+
+    inline bool operator!=(const rectangle& a, const rectangle& b) {
+        return !(a == b);
+    }
 }
 
 #endif
\ No newline at end of file
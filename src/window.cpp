@@ -10,6 +10,7 @@
 #include "font.h"
 #include "logger.h"
 #include "config.h"
+#include "renderer.h"
 
 #include <cstdio>
 #include <cstdint>
@@ -17,6 +18,7 @@
 #include <stdexcept>
 #include <iostream>
 #include <atomic>
+#include <shared_mutex>
 #include <chrono>
 #include <fcntl.h>
 #include <algorithm>
@@ -33,29 +35,30 @@ namespace window {
         return positionToCellCoordinates(pos, displayId);
     }
 
-    types::rectangle positionToPixelCoordinates(position pos, const handle& windowHandle) {
-        return positionToPixelCoordinates(pos, windowHandle.getDisplayId());
+    std::atomic<uint64_t> layoutGeneration{1};
+
+    void invalidateLayout() {
+        layoutGeneration.fetch_add(1);
     }
 
-    types::rectangle positionToPixelCoordinates(position pos, uint32_t displayId) {
-        // Get the display resolution dynamically based on the provided display ID
-        types::iVector2 currentDisplayResolution;
-        
-        // Check if we have any active displays
-        if (display::manager::activeDisplays.empty()) {
-            LOG_ERROR() << "No active displays available for window positioning" << std::endl;
-            // Return a default small window if no displays are available
-            return {{0, 0}, {800, 600}};
-        }
-        
-        // Get the resolution for the requested display
-        currentDisplayResolution = getDisplayResolution(displayId);
-        
-        // Log if we're falling back to a different display
-        if (displayId != 0 && !isValidDisplayId(displayId)) {
-            LOG_ERROR() << "Display ID " << displayId << " not found, using primary display" << std::endl;
-        }
+    uint64_t currentLayoutGeneration() {
+        // Both only ever grow, so their sum changes whenever either of them does
+        return layoutGeneration.load() + display::manager::configurationGeneration.load();
+    }
 
+    // Rectangles of every preset on one display
+    struct displayLayout {
+        uint32_t displayId;
+        types::rectangle pixels[positionCount];
+        types::rectangle cells[positionCount];
+    };
+
+    // Rebuilt only when the displays or the layout change, every other lookup is an array read. The primary display comes first.
+    static std::vector<displayLayout> layoutTable;
+    static uint64_t layoutTableGeneration = 0;
+    static std::shared_mutex layoutTableMutex;
+
+    static types::rectangle presetToPixels(position pos, types::iVector2 currentDisplayResolution) {
         // Calculate position based on the preset (in pixels)
         if (pos == position::FULLSCREEN) {
             return {{0, 0}, currentDisplayResolution};
@@ -89,20 +92,8 @@ namespace window {
         }
     }
 
-    types::rectangle positionToCellCoordinates(position pos, const handle& windowHandle) {
-        return positionToCellCoordinates(pos, windowHandle.getDisplayId());
-    }
-
-    types::rectangle positionToCellCoordinates(position pos, uint32_t displayId) {
-        // Get pixel coordinates first
-        types::rectangle pixelRect = positionToPixelCoordinates(pos, displayId);
-        
-        // Convert to cell coordinates
-        int cellWidth = font::manager::getDefaultCellWidth();
-        int cellHeight = font::manager::getDefaultCellHeight();
-        
+    static types::rectangle pixelsToCells(const types::rectangle& pixelRect, int cellWidth, int cellHeight) {
         if (cellWidth <= 0 || cellHeight <= 0) {
-            LOG_ERROR() << "Invalid cell dimensions: " << cellWidth << "x" << cellHeight << std::endl;
             // Return a reasonable default in cells
             return {{0, 0}, {80, 24}};
         }
@@ -117,16 +108,115 @@ namespace window {
         return cellRect;
     }
 
+    // Expects layoutTableMutex to be held exclusively
+    static void rebuildLayoutTable(uint64_t generation) {
+        layoutTable.clear();
+
+        int cellWidth = font::manager::getDefaultCellWidth();
+        int cellHeight = font::manager::getDefaultCellHeight();
+        
+        if (cellWidth <= 0 || cellHeight <= 0) {
+            LOG_ERROR() << "Invalid cell dimensions: " << cellWidth << "x" << cellHeight << std::endl;
+        }
+
+        for (const auto& activeDisplay : display::manager::activeDisplays) {
+            displayLayout& layout = layoutTable.emplace_back();
+            layout.displayId = activeDisplay.first;
+
+            types::iVector2 resolution = activeDisplay.second->getPreferredMode().getResolution();
+            for (size_t i = 0; i < positionCount; i++) {
+                layout.pixels[i] = presetToPixels(static_cast<position>(i), resolution);
+                layout.cells[i] = pixelsToCells(layout.pixels[i], cellWidth, cellHeight);
+            }
+        }
+
+        layoutTableGeneration = generation;
+    }
+
+    // Looks a preset up from the layout table, rebuilding it first if it's stale. Returns false if there are no displays at all.
+    static bool lookupLayout(position pos, uint32_t displayId, bool inCells, types::rectangle& result) {
+        size_t index = static_cast<size_t>(pos);
+        if (index >= positionCount) {
+            throw std::invalid_argument("Invalid position type");
+        }
+
+        uint64_t generation = currentLayoutGeneration();
+
+        auto lookup = [index, displayId, inCells, &result]() {
+            if (layoutTable.empty()) {
+                return false;
+            }
+
+            const displayLayout* layout = &layoutTable.front();
+            for (const displayLayout& candidate : layoutTable) {
+                if (candidate.displayId == displayId) {
+                    layout = &candidate;
+                    break;
+                }
+            }
+
+            // Log if we're falling back to a different display
+            if (displayId != 0 && layout->displayId != displayId) {
+                LOG_ERROR() << "Display ID " << displayId << " not found, using primary display" << std::endl;
+            }
+
+            result = inCells ? layout->cells[index] : layout->pixels[index];
+            return true;
+        };
+
+        {
+            std::shared_lock<std::shared_mutex> lock(layoutTableMutex);
+            if (layoutTableGeneration == generation) {
+                return lookup();
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(layoutTableMutex);
+        if (layoutTableGeneration != generation) {
+            rebuildLayoutTable(generation);
+        }
+        return lookup();
+    }
+
+    types::rectangle positionToPixelCoordinates(position pos, const handle& windowHandle) {
+        return positionToPixelCoordinates(pos, windowHandle.getDisplayId());
+    }
+
+    types::rectangle positionToPixelCoordinates(position pos, uint32_t displayId) {
+        types::rectangle pixelRect;
+        if (!lookupLayout(pos, displayId, false, pixelRect)) {
+            LOG_ERROR() << "No active displays available for window positioning" << std::endl;
+            // Return a default small window if no displays are available
+            return {{0, 0}, {800, 600}};
+        }
+        return pixelRect;
+    }
+
+    types::rectangle positionToCellCoordinates(position pos, const handle& windowHandle) {
+        return positionToCellCoordinates(pos, windowHandle.getDisplayId());
+    }
+
+    types::rectangle positionToCellCoordinates(position pos, uint32_t displayId) {
+        types::rectangle cellRect;
+        if (!lookupLayout(pos, displayId, true, cellRect)) {
+            LOG_ERROR() << "No active displays available for window positioning" << std::endl;
+            // Same fallback as the pixel coordinates, converted with the current cell size
+            return pixelsToCells({{0, 0}, {800, 600}}, font::manager::getDefaultCellWidth(), font::manager::getDefaultCellHeight());
+        }
+        return cellRect;
+    }
+
     void handle::poll() {
         // Self eliminate
         if (errorCount > window::handle::maxAllowedErrorCount) {
-            // Handle has too many communication errors - likely disconnected
-            close();
+            // Handle has too many communication errors - likely disconnected.
+            // Other threads may be sending to it right now, the descriptor is only released by cleanupDeadHandles.
+            connection.shutdown();
         }
 
-        // Make sure the connection is non-blocking
-        if (!connection.hasDataAvailable()) {
-            if (connection.isClosed()) {    // hasDataAvailable can close connection, so we need to check for it
+        // Only sockets the reactor reported since they were last read dry can have data
+        if (!connection.isReadable()) {
+            if (connection.isClosed()) {
                 set(window::stain::type::closed, true); // Mark area for clearing
             }
 
@@ -134,15 +224,8 @@ namespace window {
             return;
         }
 
-
-        // Check if we have an active resize stain - if so, skip this poll to avoid buffer misalignment
-        if (stain::has(dirty, stain::type::resize)) {
-            LOG_VERBOSE() << "Handle has active resize stain, skipping poll to avoid buffer misalignment" << std::endl;
-            return;
-        }
-
         // Now we can send the first packet to GGUI client, and it is the size of it at fullscreen.
-        types::rectangle windowRectangle = positionToCellCoordinates(preset, displayId);
+        types::rectangle windowRectangle = getCellCoordinates();
 
         types::iVector2 dimensionsInCells = {
             windowRectangle.size.x,
@@ -150,6 +233,8 @@ namespace window {
         };
 
         unsigned int requiredSize = dimensionsInCells.x * dimensionsInCells.y;
+        size_t maximumBufferSize = requiredSize * sizeof(types::Cell);
+        bool covered;   // Whether nothing of this handle is on screen right now
 
         // Protect cellBuffer access with mutex
         {
@@ -158,120 +243,296 @@ namespace window {
             if (requiredSize != cellBuffer->size()) {
                 // Resize the buffer to match the required size
                 cellBuffer->resize(requiredSize);
+                deltaBaseValid = false;     // Deltas made for the old size would land on the wrong cells
+                deferredEncodedLength = 0;
                 LOG_VERBOSE() << "Resized cell buffer to " << requiredSize << " cells (" 
                               << dimensionsInCells.x << "x" << dimensionsInCells.y << ")" << std::endl;
             }
 
-            // Now we'll get the buffer data from the GGUI client.
             if (!cellBuffer || cellBuffer->empty()) {
                 LOG_ERROR() << "Cell buffer is invalid or empty" << std::endl;
                 errorCount++;
                 return;
             }
 
-            size_t maximumBufferSize = requiredSize * sizeof(types::Cell);
+            covered = visibility.full();
+        }
+
+        // Frames may arrive in any number of pieces, the reader picks up where the last poll left off
+        for (unsigned int framesRead = 0; framesRead < maxFramesPerPoll; ) {
+            tcp::frameReader::status progress = reader.read(connection);
 
-            // Try to receive a packet header first
-            char* packetBuffer = new char[packet::size + maximumBufferSize];
-            
-            if (!connection.ReceiveNonBlocking(packetBuffer, packet::size + maximumBufferSize)) {
-                // No complete packet available, but check if we have any partial data that might indicate buffer misalignment
-                if (connection.hasDataAvailable()) {
-                    // If we've had recent errors, this might be misaligned data - consider flushing
-                    if (errorCount > 0) {
-                        flushTcpReceiveBuffer();
+            if (progress == tcp::frameReader::status::PENDING) {
+                return;
+            }
+            if (progress == tcp::frameReader::status::BROKEN) {
+                set(window::stain::type::closed, true); // Mark area for clearing
+                return;
+            }
+
+            const packet::frame::header& frameHeader = reader.header();
+
+            if (progress == tcp::frameReader::status::HEADER) {
+                // Cells which fit the window are received aside and swapped in once complete, so the renderer never sees half a frame
+                receivingCells = frameHeader.packetType == static_cast<uint16_t>(packet::type::DRAW_BUFFER) && frameHeader.payloadLength == maximumBufferSize;
+
+                if (receivingCells) {
+                    incomingCells.resize(requiredSize);
+                    reader.setPayloadTarget(incomingCells.data());
+                }
+                else {
+                    // Everything else, including cells sized for a window we no longer have, lands in the scratch buffer
+                    if (receiveBuffer.size() < frameHeader.payloadLength) {
+                        receiveBuffer.resize(frameHeader.payloadLength);
                     }
+                    reader.setPayloadTarget(receiveBuffer.data());
                 }
-                else if (connection.isClosed()) {    // hasDataAvailable can close connection, so we need to check for it
-                    set(window::stain::type::closed, true); // Mark area for clearing
+                continue;
+            }
+
+            framesRead++;
+            packet::type frameType = static_cast<packet::type>(frameHeader.packetType);
+
+            LOG_VERBOSE() << "Received frame " << frameHeader.sequence << " of type " << static_cast<int>(frameType) << " with " << frameHeader.payloadLength << " bytes" << std::endl;
+
+            if (frameType == packet::type::DRAW_BUFFER) {
+                if (!receivingCells) {
+                    // Sent before the client learned of its new size
+                    LOG_VERBOSE() << "Dropped draw buffer of " << frameHeader.payloadLength << " bytes, expected " << maximumBufferSize << " bytes" << std::endl;
+                    continue;
                 }
-                
-                delete[] packetBuffer;
-                return;
+
+                deferredEncodedLength = 0;
+                commitIncomingCells(dimensionsInCells.y);
+
+                LOG_VERBOSE() << "Successfully received draw buffer with " << requiredSize << " cells (" << maximumBufferSize << " bytes)" << std::endl;
             }
+            else if (frameType == packet::type::DRAW_ENCODED) {
+                if (packet::encoded::cellCountOf(receiveBuffer.data(), frameHeader.payloadLength) != requiredSize) {
+                    // Sent before the client learned of its new size
+                    LOG_VERBOSE() << "Dropped encoded draw buffer not made for " << requiredSize << " cells" << std::endl;
+                    continue;
+                }
 
-            // Cast to base packet to check type
-            packet::base* basePacket = reinterpret_cast<packet::base*>(packetBuffer);
-            
-            LOG_VERBOSE() << "Received packet type: " << static_cast<int>(basePacket->packetType) << std::endl;
-            
-            if (basePacket->packetType == packet::type::NOTIFY) {
-                // Cast to notify packet
-                packet::notify::base* notifyPacket = reinterpret_cast<packet::notify::base*>(packetBuffer);
+                if (covered) {
+                    // Nobody would see the decoded cells, keep the payload until the handle shows again and decode only the latest one
+                    deferredEncoded.swap(receiveBuffer);
+                    deferredEncodedLength = frameHeader.payloadLength;
+                    LOG_VERBOSE() << "Deferred encoded draw buffer of " << frameHeader.payloadLength << " bytes, the window is covered" << std::endl;
+                    continue;
+                }
+
+                deferredEncodedLength = 0;
+                incomingCells.resize(requiredSize);
+                if (!packet::encoded::decode(receiveBuffer.data(), frameHeader.payloadLength, incomingCells.data(), requiredSize)) {
+                    LOG_ERROR() << "Malformed encoded draw buffer of " << frameHeader.payloadLength << " bytes" << std::endl;
+                    errorCount++;
+                    continue;
+                }
+
+                commitIncomingCells(dimensionsInCells.y);
+
+                LOG_VERBOSE() << "Successfully decoded draw buffer with " << requiredSize << " cells from " << frameHeader.payloadLength << " bytes" << std::endl;
+            }
+            else if (frameType == packet::type::DRAW_DELTA) {
+                // Deltas patch the latest full frame, so a deferred one has to be in place first
+                if (!decodeDeferred()) {
+                    continue;
+                }
+
+                if (!applyDelta(receiveBuffer.data(), frameHeader.payloadLength, dimensionsInCells.x)) {
+                    continue;
+                }
+            }
+            else if (frameType == packet::type::SHARED_SETUP) {
+                int memoryFd = connection.takeReceivedFd();
+                if (frameHeader.payloadLength < sizeof(packet::shared::setup) || memoryFd < 0) {
+                    LOG_ERROR() << "Shared memory setup without " << (memoryFd < 0 ? "a memory descriptor" : "a slot layout") << std::endl;
+                    if (memoryFd >= 0) {
+                        ::close(memoryFd);
+                    }
+                    errorCount++;
+                    continue;
+                }
+
+                packet::shared::setup layout;
+                memcpy(&layout, receiveBuffer.data(), sizeof(layout));
+
+                if (!sharedCells.map(memoryFd, layout)) {
+                    errorCount++;
+                    continue;
+                }
+
+                LOG_VERBOSE() << "Mapped shared memory ring of " << layout.slotCount << " slots of " << layout.slotSize << " bytes" << std::endl;
+            }
+            else if (frameType == packet::type::SHARED_DOORBELL) {
+                if (frameHeader.payloadLength < sizeof(packet::shared::doorbell)) {
+                    LOG_ERROR() << "Doorbell frame too short: " << frameHeader.payloadLength << " bytes" << std::endl;
+                    errorCount++;
+                    continue;
+                }
+
+                packet::shared::doorbell bell;
+                memcpy(&bell, receiveBuffer.data(), sizeof(bell));
+
+                incomingCells.resize(requiredSize);
+                if (!sharedCells.consume(bell.slot, incomingCells.data(), requiredSize)) {
+                    // Either made before the client learned of its new size, or rung for a slot which wasn't ready
+                    LOG_VERBOSE() << "Dropped shared memory slot " << bell.slot << ", it held no frame of " << requiredSize << " cells" << std::endl;
+                    continue;
+                }
+
+                deferredEncodedLength = 0;
+                commitIncomingCells(dimensionsInCells.y);
+            }
+            else if (frameType == packet::type::NOTIFY) {
+                if (frameHeader.payloadLength < sizeof(packet::notify::base)) {
+                    LOG_ERROR() << "Notify frame too short: " << frameHeader.payloadLength << " bytes" << std::endl;
+                    errorCount++;
+                    continue;
+                }
+
+                packet::notify::base* notifyPacket = reinterpret_cast<packet::notify::base*>(receiveBuffer.data());
 
                 if (notifyPacket->notifyType == packet::notify::type::EMPTY_BUFFER) {
-                    // If the buffer is empty, we can skip receiving the cell data
+                    // Nothing changed on the client side, keep showing what we have
                     LOG_VERBOSE() << "Received empty buffer notification, skipping frame" << std::endl;
-                    delete[] packetBuffer;
-                    return;  // Skip to the next handle
                 } 
                 else if (notifyPacket->notifyType == packet::notify::type::CLOSED) {
                     LOG_VERBOSE() << "Received closed notification, shutting down connection" << std::endl;
-                    connection.close();
-                    delete[] packetBuffer;
-                    return;  // Skip to the next handle
+                    connection.shutdown();
+                    set(window::stain::type::closed, true); // Mark area for clearing
+                    return;
                 } else {
                     LOG_ERROR() << "Unknown notify flag received: " << static_cast<int>(notifyPacket->notifyType) << std::endl;
                     errorCount++;
-                    delete[] packetBuffer;
-                    return;  // Skip to the next handle
-                }
-            }
-            else if (basePacket->packetType == packet::type::DRAW_BUFFER) {
-                // Validate that the received buffer size matches what we expect
-                size_t cellDataSize = cellBuffer->size() * sizeof(types::Cell);
-                size_t availableData = packet::size + maximumBufferSize - packet::size; // Data portion of the packet
-                
-                if (cellDataSize > availableData) {
-                    LOG_ERROR() << "Buffer size mismatch - expected " << cellDataSize 
-                               << " bytes but packet only contains " << availableData << " bytes" << std::endl;
-                    
-                    // This indicates a serious buffer misalignment, flush TCP buffer
-                    flushTcpReceiveBuffer();
-                    
-                    errorCount++;
-                    delete[] packetBuffer;
-                    return;
+                    continue;
                 }
-                
-                // Now we can safely copy over from the packetBuffer the cell data
-                memcpy(cellBuffer->data(), packetBuffer + packet::size, cellDataSize);
-
-                LOG_VERBOSE() << "Successfully received draw buffer with " << cellBuffer->size() << " cells (" << cellDataSize << " bytes)" << std::endl;
             }
-            else if (basePacket->packetType == packet::type::INPUT) {
+            else if (frameType == packet::type::INPUT) {
                 // Input packets are handled elsewhere, ignore them here
                 LOG_VERBOSE() << "Received INPUT packet in handle poll (should be handled by input system)" << std::endl;
-                delete[] packetBuffer;
-                return;
             }
-            else if (basePacket->packetType == packet::type::RESIZE) {
+            else if (frameType == packet::type::RESIZE) {
                 // Resize packets should be handled elsewhere, ignore them here  
                 LOG_VERBOSE() << "Received RESIZE packet in handle poll (should be handled separately)" << std::endl;
-                delete[] packetBuffer;
-                return;
             }
             else {
-                LOG_ERROR() << "Unknown packet type received: " << static_cast<int>(basePacket->packetType) << " (raw bytes: " << std::hex;
-                for (int i = 0; i < 8 && i < packet::size; i++) {
-                    LOG_ERROR() << " 0x" << static_cast<unsigned char>(packetBuffer[i]);
-                }
-                LOG_ERROR() << std::dec << ")" << std::endl;
-                
-                // Flush TCP buffers to prevent buffer misalignment from corrupted/unexpected packets
-                flushTcpReceiveBuffer();
-                
+                // The frame length already carried us past it, so the stream stays aligned
+                LOG_ERROR() << "Unknown packet type received: " << static_cast<int>(frameHeader.packetType) << std::endl;
                 errorCount++;
-                delete[] packetBuffer;
-                return;
+                continue;
+            }
+
+            // Set the errorCount to zero if everything worked.
+            errorCount = 0;
+        }
+    }
+
+    void handle::commitIncomingCells(int rows) {
+        std::lock_guard<std::mutex> lock(cellBufferMutex);
+
+        // A resize may have happened while the frame was in transit
+        if (cellBuffer->size() == incomingCells.size()) {
+            cellBuffer->swap(incomingCells);
+            changedRows.include(0, rows);
+            deltaBaseValid = true;
+        }
+    }
+
+    bool handle::decodeDeferred() {
+        if (deferredEncodedLength == 0) {
+            return true;
+        }
+
+        // A draw buffer is being received into incomingCells, it replaces the deferred one once complete anyway
+        if (receivingCells && reader.inFrame()) {
+            return true;
+        }
+
+        size_t length = deferredEncodedLength;
+        deferredEncodedLength = 0;
+
+        types::rectangle windowRectangle = getCellCoordinates();
+        size_t requiredSize = static_cast<size_t>(windowRectangle.size.x) * static_cast<size_t>(windowRectangle.size.y);
+
+        incomingCells.resize(requiredSize);
+        if (packet::encoded::cellCountOf(deferredEncoded.data(), length) != requiredSize || !packet::encoded::decode(deferredEncoded.data(), length, incomingCells.data(), requiredSize)) {
+            LOG_ERROR() << "Malformed deferred encoded draw buffer of " << length << " bytes" << std::endl;
+            errorCount++;
+
+            // Whatever the client patches next was made against the frame we just lost
+            std::lock_guard<std::mutex> lock(cellBufferMutex);
+            deltaBaseValid = false;
+            return false;
+        }
+
+        commitIncomingCells(windowRectangle.size.y);
+        return true;
+    }
+
+    bool handle::applyDelta(const char* payload, size_t length, int rowWidth) {
+        std::lock_guard<std::mutex> lock(cellBufferMutex);
+
+        if (!deltaBaseValid) {
+            // Sent before the client learned of its new size, the full frame following the resize replaces it anyway
+            LOG_VERBOSE() << "Dropped draw delta, no full draw buffer of the current size received yet" << std::endl;
+            return false;
+        }
+
+        // Validate every span before touching the cells, so the renderer never sees half a delta
+        size_t position = 0;
+        while (position < length) {
+            packet::delta::span span;
+            if (length - position < sizeof(span)) {
+                break;
+            }
+            memcpy(&span, payload + position, sizeof(span));
+            position += sizeof(span);
+
+            size_t spanBytes = static_cast<size_t>(span.count) * sizeof(types::Cell);
+            if (static_cast<size_t>(span.offset) + span.count > cellBuffer->size() || spanBytes > length - position) {
+                break;
+            }
+            position += spanBytes;
+        }
+
+        if (position != length) {
+            LOG_ERROR() << "Malformed draw delta of " << length << " bytes, spans end at byte " << position << std::endl;
+            errorCount++;
+            return false;
+        }
+
+        for (position = 0; position < length; ) {
+            packet::delta::span span;
+            memcpy(&span, payload + position, sizeof(span));
+            position += sizeof(span);
+
+            if (span.count == 0) {
+                continue;
             }
 
-            // Clean up allocated memory
-            delete[] packetBuffer;
-        } // End of cellBuffer mutex lock
+            memcpy(cellBuffer->data() + span.offset, payload + position, span.count * sizeof(types::Cell));
+            position += span.count * sizeof(types::Cell);
+
+            changedRows.include(span.offset / rowWidth, (span.offset + span.count - 1) / rowWidth + 1);
+        }
+
+        LOG_VERBOSE() << "Applied draw delta of " << length << " bytes" << std::endl;
+        return true;
+    }
+
+    handle::geometryCache handle::getGeometry() const {
+        std::lock_guard<std::mutex> lock(geometryMutex);
 
-        // Set the errorCount to zero if everything worked.
-        errorCount = 0;
+        uint64_t generation = currentLayoutGeneration();
+        if (geometry.generation != generation) {
+            geometry.pixels = positionToPixelCoordinates(preset, displayId);
+            geometry.cells = positionToCellCoordinates(preset, displayId);
+            geometry.generation = generation;
+        }
+
+        return geometry;
     }
 
     font::font* handle::getFont() const {
@@ -320,44 +581,125 @@ namespace window {
         return clearArea;
     }
 
-    void handle::flushTcpReceiveBuffer() {
-        LOG_VERBOSE() << "Flushing TCP receive buffer to prevent misalignment" << std::endl;
-        
-        types::rectangle rect = window::positionToCellCoordinates(previousPreset, displayId);
-        size_t drainBufferSize = sizeof(types::Cell) * rect.size.x * rect.size.y;
-
-        char* drainBuffer = new char[drainBufferSize];
-        int drainedTotal = 0;
-        
-        while (connection.hasDataAvailable()) {
-            ssize_t drained = recv(connection.getHandle(), drainBuffer, drainBufferSize, MSG_DONTWAIT);
-            if (drained <= 0) {
-                break; // No more data or error
-            }
-            drainedTotal += drained;
-        }
-        
-        if (drainedTotal > 0) {
-            LOG_VERBOSE() << "Drained " << drainedTotal << " bytes total from TCP buffer" << std::endl;
-        }
-    }
-
     namespace manager {
         // Define the global variables
-        atomic::guard<std::vector<handle>> handles;
+        atomic::guard<handleStore> handles;
         atomic::guard<tcp::listener> listener;
+        atomic::guard<tcp::listener> localListener;
+        tcp::reactor connections;
         
         // Shutdown control
         std::atomic<bool> shouldShutdown{false};
         
         // Focus management for input system
-        static handle* currentFocusedHandle = nullptr;
+        static std::atomic<handleId> currentFocusedHandle{handleId{}};
+
+        // Connections which finished their handshake, waiting for the renderer to turn them into handles at its next frame
+        static atomic::guard<std::vector<tcp::connection>> arrivals;
         
         const char* handshakeInitializedFileName = "/tmp/GGDirect.gateway";  // This file will contain the port this manager is listening at
+        const char* localSocketFileName = "/tmp/GGDirect.socket";           // Local clients connect here directly, skipping the TCP handshake
+
+        // Handshakes which haven't answered by then are dropped, so a stuck client can't hold on to its sockets
+        constexpr std::chrono::milliseconds handshakeTimeout{2000};
+
+        // How often the reception thread checks for shutdown and expired handshakes while nothing happens
+        constexpr std::chrono::milliseconds receptionPollInterval{100};
+
+        // A TCP handshake in flight, the reception thread advances it whenever one of its sockets becomes ready
+        struct pendingHandshake {
+            tcp::connection gateway;    // Accepted on the listener, the client sends its own port here
+            tcp::connection client;     // Our connection back to the client's port, open once the port has arrived
+            uint16_t port = 0;
+            std::chrono::steady_clock::time_point deadline;
+        };
+
+        // Queues a finished connection to become a new window, without waiting for the renderer to finish its frame
+        static void adoptConnection(tcp::connection& gguiConnection) {
+            if (!connections.watch(gguiConnection)) {
+                LOG_ERROR() << "Failed to watch GGUI connection, its updates will only show up with other activity" << std::endl;
+            }
+
+            arrivals([&gguiConnection](std::vector<tcp::connection>& self){
+                self.push_back(std::move(gguiConnection));
+            });
+
+            // The renderer only watches sockets it knew about when it went idle
+            renderer::wake();
+        }
+
+        void adoptArrivals(handleStore& windowHandles) {
+            bool adopted = false;
+
+            arrivals([&windowHandles, &adopted](std::vector<tcp::connection>& self){
+                for (tcp::connection& gguiConnection : self) {
+                    windowHandles.emplace(std::move(gguiConnection));
+                    adopted = true;
+                }
+                self.clear();
+            });
+
+            if (adopted) {
+                assignDisplaysToHandles(windowHandles);
+            }
+        }
+
+        // Advances a handshake whose socket became ready, returns false once it's finished or failed and can be dropped
+        static bool advanceHandshake(pendingHandshake& pending, tcp::reactor& acceptor) {
+            if (pending.client.isClosed()) {
+                // We will first listen for GGUI to give its own port to establish an personal connection to this specific GGUI client
+                pending.gateway.markReadable();     // Level triggered, so being reported means there is something to read
+                if (!pending.gateway.ReceivePacketNonBlocking(&pending.port)) {
+                    if (pending.gateway.isClosed()) {
+                        LOG_ERROR() << "GGUI closed the handshake before sending its port" << std::endl;
+                        return false;
+                    }
+                    return true;    // Only part of the port has arrived
+                }
+
+                LOG_VERBOSE() << "Received GGUI port: " << pending.port << std::endl;
+                acceptor.unwatch(pending.gateway.getHandle());
+
+                // Now we can create a new connection with this new port
+                try {
+                    pending.client = tcp::sender::beginConnection(pending.port);
+                } catch (const std::runtime_error& e) {
+                    LOG_ERROR() << "Failed to connect to GGUI: " << e.what() << std::endl;
+                    return false;
+                }
+
+                if (!acceptor.watch(pending.client.getHandle(), false, true)) {
+                    return false;
+                }
+                return true;
+            }
+
+            // The connection back to the client has finished connecting, one way or the other
+            int error = pending.client.getPendingError();
+            acceptor.unwatch(pending.client.getHandle());
+
+            if (error != 0) {
+                LOG_ERROR() << "Failed to connect to GGUI on port " << pending.port << ": " << strerror(error) << std::endl;
+                return false;
+            }
+
+            LOG_VERBOSE() << "Established connection to GGUI on port " << pending.port << std::endl;
+
+            // Before going to the next connection, we need to send confirmation back to the GGUI that we have accepted the connection
+            if (!pending.client.Send(&pending.port)) {
+                LOG_ERROR() << "Failed to send confirmation to GGUI" << std::endl;
+                return false;
+            }
+
+            LOG_VERBOSE() << "Handshake complete!" << std::endl;
+
+            adoptConnection(pending.client);
+            return false;
+        }
 
         // Sets up the secondary thread which is responsible for the handshakes
         void init() {
-            uint32_t uniquePort;
+            uint32_t uniquePort = 0;
 
             try {
                 // init global listener and get a unique port number
@@ -377,82 +719,98 @@ namespace window {
                     return;
                 }
 
-                // Now we will start listening for connections
+                // Local clients get their own unix socket, TCP stays for remote ones
+                try {
+                    localListener([](tcp::listener& self){
+                        self = tcp::listener(std::string(localSocketFileName));
+                    });
+                } catch (const std::runtime_error& e) {
+                    LOG_ERROR() << "Local clients will have to use TCP: " << e.what() << std::endl;
+                }
+
+                // Now we will start listening for connections, every socket involved is non-blocking so no single client can hold up the others
                 std::thread reception = std::thread([]() {
                     LOG_VERBOSE() << "Waiting for GGUI client connections..." << std::endl;
 
+                    tcp::reactor acceptor;
+                    int listenerFd = -1;
+                    int localListenerFd = -1;
+
+                    // Listeners are drained until they'd block, so they have to be non-blocking
+                    auto watchListener = [&acceptor](tcp::listener& self) {
+                        int fd = self.getHandle();
+                        int flags = fcntl(fd, F_GETFL, 0);
+                        if (flags >= 0) {
+                            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+                        }
+                        return acceptor.watch(fd, false) ? fd : -1;
+                    };
+
+                    listener([&watchListener, &listenerFd](tcp::listener& self){
+                        listenerFd = watchListener(self);
+                    });
+                    localListener([&watchListener, &localListenerFd](tcp::listener& self){
+                        localListenerFd = watchListener(self);
+                    });
+
+                    std::vector<pendingHandshake> pending;
+                    std::vector<int> readyFds;
+
                     while (!shouldShutdown.load()) {
-                        try {
-                            // Use the atomic guard to safely access the listener and get a connection
-                            listener([](tcp::listener& listenerRef){
-                                // Set listener socket to non-blocking mode to allow checking shutdown flag
-                                int listenerFd = listenerRef.getHandle();
-                                if (listenerFd >= 0) {
-                                    int flags = fcntl(listenerFd, F_GETFL, 0);
-                                    if (flags >= 0) {
-                                        fcntl(listenerFd, F_SETFL, flags | O_NONBLOCK);
-                                    }
-                                }
-                                
-                                try {
-                                    tcp::connection conn = listenerRef.Accept();
-                                    LOG_VERBOSE() << "initiating GGUI handshake..." << std::endl;
-                                    
-                                    // Process the connection normally...
-                                    // We will first listen for GGUI to give its own port to establish an personal connection to this specific GGUI client
-                                    uint16_t gguiPort;
-                                    if (!conn.Receive(&gguiPort)) {
-                                        LOG_ERROR() << "Failed to receive GGUI port" << std::endl;
-                                        return;
-                                    }
+                        auto now = std::chrono::steady_clock::now();
 
-                                    LOG_VERBOSE() << "Received GGUI port: " << gguiPort << std::endl;
+                        // Wake up in time for the closest deadline
+                        auto timeout = receptionPollInterval;
+                        for (const pendingHandshake& handshake : pending) {
+                            timeout = std::min(timeout, std::chrono::duration_cast<std::chrono::milliseconds>(handshake.deadline - now));
+                        }
 
-                                    // Now we can create a new connection with this new port
-                                    tcp::connection gguiConnection = tcp::sender::getConnection(gguiPort);
-                                    
-                                    LOG_VERBOSE() << "Established connection to GGUI on port " << gguiPort << std::endl;
-                                    
-                                    // Set the connection to non-blocking mode for better performance
-                                    if (!gguiConnection.setNonBlocking()) {
-                                        LOG_ERROR() << "Warning: Failed to set connection to non-blocking mode" << std::endl;
-                                    }
+                        if (acceptor.wait(readyFds, static_cast<int>(std::max(timeout.count(), static_cast<long>(0)))) < 0) {
+                            std::this_thread::sleep_for(receptionPollInterval);     // Don't spin on a broken epoll
+                        }
 
-                                    // Before going to the next connection, we need to send confirmation back to the GGUI that we have accepted the connection
-                                    if (!gguiConnection.Send(&gguiPort)) {
-                                        LOG_ERROR() << "Failed to send confirmation to GGUI" << std::endl;
-                                        return;
-                                    }
+                        for (int fd : readyFds) {
+                            if (fd == listenerFd) {
+                                listener([&acceptor, &pending](tcp::listener& self){
+                                    tcp::connection gateway;
+                                    while (self.TryAccept(gateway)) {
+                                        LOG_VERBOSE() << "initiating GGUI handshake..." << std::endl;
 
-                                    LOG_VERBOSE() << "Handshake complete!" << std::endl;
-                                    
-                                    // Create a new handle for this connection
-                                    handles([&gguiConnection](std::vector<handle>& self){
-                                        self.emplace_back(std::move(gguiConnection));
-
-                                        assignDisplaysToHandles(self);
-                                    });
-                                } catch (const std::runtime_error& e) {
-                                    // This is expected when no connections are pending (non-blocking mode)
-                                    // We'll just continue and check again in the next iteration
-                                    std::string error_msg = e.what();
-                                    if (error_msg.find("Failed to accept connection") != std::string::npos) {
-                                        // No connection pending, this is normal in non-blocking mode
-                                        return;
-                                    } else {
-                                        // Some other error, log it
-                                        LOG_ERROR() << "Unexpected error in connection handling: " << e.what() << std::endl;
-                                        return;
+                                        acceptor.watch(gateway.getHandle(), false);
+                                        pending.push_back({std::move(gateway), tcp::connection(), 0, std::chrono::steady_clock::now() + handshakeTimeout});
                                     }
+                                });
+                            }
+                            else if (fd == localListenerFd) {
+                                // Local clients need no port exchange, their accepted connection is already the final one
+                                localListener([](tcp::listener& self){
+                                    tcp::connection gguiConnection;
+                                    while (self.TryAccept(gguiConnection)) {
+                                        LOG_VERBOSE() << "Local GGUI client connected" << std::endl;
+                                        adoptConnection(gguiConnection);
+                                    }
+                                });
+                            }
+                            else {
+                                auto handshake = std::find_if(pending.begin(), pending.end(), [fd](const pendingHandshake& candidate) {
+                                    return candidate.gateway.getHandle() == fd || candidate.client.getHandle() == fd;
+                                });
+
+                                if (handshake != pending.end() && !advanceHandshake(*handshake, acceptor)) {
+                                    pending.erase(handshake);   // Closing the sockets also removes them from the acceptor
                                 }
-                            });
-                        } catch (const std::exception& e) {
-                            LOG_ERROR() << "Error in reception thread: " << e.what() << std::endl;
-                            continue;
+                            }
                         }
-                        
-                        // Small sleep to prevent busy waiting when no connections are pending
-                        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+                        // Drop handshakes which took too long
+                        now = std::chrono::steady_clock::now();
+                        pending.erase(std::remove_if(pending.begin(), pending.end(), [now](const pendingHandshake& handshake) {
+                            if (handshake.deadline > now) {
+                                return false;
+                            }
+                            LOG_ERROR() << "GGUI handshake timed out" << std::endl;
+                            return true;
+                        }), pending.end());
                     }
                     LOG_VERBOSE() << "Reception thread exiting..." << std::endl;
                 });
@@ -474,33 +832,34 @@ namespace window {
             std::this_thread::sleep_for(std::chrono::milliseconds(200));
             
             // Close all handles
-            handles([](std::vector<handle>& self){
+            handles([](handleStore& self){
                 for (auto& h : self) {
                     h.close(); // Close each connection
                 }
-                self.clear(); // Clear the vector
+                self.clear(); // Clear the store
             });
             
+            // The unix socket file is removed with its listener, so clients don't find a stale one
+            localListener([](tcp::listener& self){
+                self = tcp::listener();
+            });
+
             // listener destructor will be called automatically via atomic::guard
             LOG_VERBOSE() << "Window manager shutdown complete." << std::endl;
         }
         
         // Focus management functions
+        // Focus is kept as an id, input routing and actions resolve it through the store so a removed window can't be reached
         void setFocusedHandle(handle* focusedHandle) {
-            currentFocusedHandle = focusedHandle;
-            // Update the input system's focused handle
-            input::manager::setFocusedHandle(static_cast<void*>(focusedHandle));
+            currentFocusedHandle = focusedHandle ? focusedHandle->id : handleId{};
         }
         
-        handle* getFocusedHandle() {
-            if (!currentFocusedHandle)
-                setFocusOnNextAvailableHandle();
-
-            return currentFocusedHandle;
+        handleId getFocusedHandleId() {
+            return currentFocusedHandle.load();
         }
         
         void setFocusedHandleByIndex(size_t index) {
-            handles([index](std::vector<handle>& self) {
+            handles.read([index](const handleStore& self) {
                 if (index < self.size()) {
                     setFocusedHandle(&self[index]);
                 }
@@ -508,22 +867,17 @@ namespace window {
         }
 
         void setFocusOnNextAvailableHandle() {
-            handles([](std::vector<handle>& self) {
+            handles.read([](const handleStore& self) {
                 if (self.empty()) {
                     LOG_ERROR() << "No available handles to focus on" << std::endl;
                     return;
                 }
 
-                if (currentFocusedHandle && self.size() > 1) {
+                handleId focusedId = currentFocusedHandle.load();
+                if (self.get(focusedId) && self.size() > 1) {
                     // We can now find the current index and then return the currentIndex+1
-                    size_t currentIndex = 0;
-
-                    for (size_t i = 0; i < self.size(); ++i) {
-                        if (&self[i] == currentFocusedHandle) {
-                            currentIndex = i;
-                            break;
-                        }
-                    }
+                    const std::vector<handleId>& order = self.order();
+                    size_t currentIndex = std::find(order.begin(), order.end(), focusedId) - order.begin();
 
                     // Set the next handle as focused, wrapping around if necessary
                     size_t nextIndex = (currentIndex + 1) % self.size();
@@ -548,7 +902,7 @@ namespace window {
         
         size_t getActiveHandleCount() {
             size_t count = 0;
-            handles([&count](std::vector<handle>& self) {
+            handles.read([&count](const handleStore& self) {
                 count = self.size();
             });
             return count;
@@ -556,7 +910,7 @@ namespace window {
         
         // Display management functions
         void distributeHandlesAcrossDisplays() {
-            handles([](std::vector<handle>& self) {
+            handles([](handleStore& self) {
                 if (self.empty() || display::manager::activeDisplays.empty()) {
                     return;
                 }
@@ -601,7 +955,7 @@ namespace window {
         }
 
         // Display assignment strategies
-        void assignDisplaysToHandles(std::vector<handle>& windowHandles) {
+        void assignDisplaysToHandles(handleStore& windowHandles) {
             if (windowHandles.empty() || display::manager::activeDisplays.empty()) {
                 return;
             }
@@ -628,7 +982,7 @@ namespace window {
         }
 
         // Professional tiling layout patterns - helper function
-        void applyTilingLayout(std::vector<handle>& windowHandles, const std::vector<size_t>& windowIndices, uint32_t displayId) {
+        void applyTilingLayout(handleStore& windowHandles, const std::vector<size_t>& windowIndices, uint32_t displayId) {
             size_t windowCount = windowIndices.size();
             
             LOG_VERBOSE() << "Applying tiling layout for " << windowCount << " windows on display " << displayId << std::endl;
@@ -672,7 +1026,7 @@ namespace window {
             }
         }
 
-        void fitHandlesToDisplay(std::vector<handle>& windowHandles, std::vector<uint32_t>& displayIds) {
+        void fitHandlesToDisplay(handleStore& windowHandles, std::vector<uint32_t>& displayIds) {
             // Professional tiling window manager with smart positioning
             // The newest handle is the last member in the handles list and gets priority placement
 
@@ -718,7 +1072,7 @@ namespace window {
 
         // This function setups the new window in the GGDirect space, so that it fits well with other open windows.
         void assignNewWindowToDisplay(handle& newHandle, position pos) {    
-            newHandle.preset = pos;
+            newHandle.setPreset(pos);
             
             types::rectangle windowRectangle = positionToCellCoordinates(pos, newHandle.getDisplayId());
 
@@ -736,10 +1090,24 @@ namespace window {
             memcpy(packetBuffer, &newsize, sizeof(newsize));
 
             // Send the resize packet
-            if (!newHandle.connection.Send(packetBuffer, packet::size)) {
+            if (!newHandle.connection.SendFrame(packet::type::RESIZE, packetBuffer, packet::size)) {
                 LOG_ERROR() << "Failed to send resize packet to GGUI" << std::endl;
                 return;
             }
+
+            // Let the client know it may send its cells in the compact encoding
+            new(packetBuffer) packet::notify::base(packet::notify::type::ENCODED_BUFFERS);
+            if (!newHandle.connection.SendFrame(packet::type::NOTIFY, packetBuffer, packet::size)) {
+                LOG_ERROR() << "Failed to send encoding support notify to GGUI" << std::endl;
+            }
+
+            // Local clients can skip the socket for their cells altogether
+            if (newHandle.connection.isLocal()) {
+                new(packetBuffer) packet::notify::base(packet::notify::type::SHARED_MEMORY);
+                if (!newHandle.connection.SendFrame(packet::type::NOTIFY, packetBuffer, packet::size)) {
+                    LOG_ERROR() << "Failed to send shared memory support notify to GGUI" << std::endl;
+                }
+            }
             
             // Always set the new client as the new focused handle.
             setFocusedHandle(&newHandle);
@@ -749,7 +1117,10 @@ namespace window {
         
         // Display monitoring and updates
         void updateHandleDisplays() {
-            handles([](std::vector<handle>& self) {
+            // Resolutions may have changed along with the displays
+            invalidateLayout();
+
+            handles([](handleStore& self) {
                 for (auto& handle : self) {
                     // Check if the handle's display still exists
                     if (!isValidDisplayId(handle.getDisplayId())) {
@@ -764,7 +1135,7 @@ namespace window {
         // Get information about handle distribution across displays
         std::map<uint32_t, size_t> getHandleDistribution() {
             std::map<uint32_t, size_t> distribution;
-            handles([&distribution](std::vector<handle>& self) {
+            handles.read([&distribution](const handleStore& self) {
                 for (const auto& handle : self) {
                     distribution[handle.getDisplayId()]++;
                 }
@@ -775,7 +1146,7 @@ namespace window {
         // Debug function to print current handle-display mapping
         void printHandleDisplayMapping() {
             LOG_VERBOSE() << "=== Handle-Display Mapping ===" << std::endl;
-            handles([](std::vector<handle>& self) {
+            handles.read([](const handleStore& self) {
                 for (size_t i = 0; i < self.size(); ++i) {
                     LOG_VERBOSE() << "Handle " << i << " -> Display " 
                                   << self[i].getDisplayId() << std::endl;
@@ -791,30 +1162,18 @@ namespace window {
         
         // Cleanup management functions
         void cleanupDeadHandles() {
-            handles([](std::vector<handle>& self) {
-                auto it = std::remove_if(self.begin(), self.end(), [](const handle& h) {
-                    return h.connection.getHandle() < 0 && !window::stain::has(h.dirty, window::stain::type::closed);
+            // Connections are only shut down while the store is shared, their descriptors are closed here when the handles are
+            // destroyed, with nobody else holding the lock who could still be sending to them
+            handles([](handleStore& self) {
+                size_t removedCount = self.removeIf([](const handle& h) {
+                    return h.connection.isClosed() && !window::stain::has(h.dirty, window::stain::type::closed);
                 });
                 
-                if (it != self.end()) {
-                    // Check if the focused handle is being removed
-                    handle* focused = getFocusedHandle();
-                    bool focusedHandleRemoved = false;
-                    
-                    for (auto removeIt = it; removeIt != self.end(); ++removeIt) {
-                        if (focused == &(*removeIt)) {
-                            focusedHandleRemoved = true;
-                            break;
-                        }
-                    }
-                    
-                    size_t removedCount = std::distance(it, self.end());
-                    self.erase(it, self.end());
-                    
+                if (removedCount > 0) {
                     LOG_INFO() << "Cleaned up " << removedCount << " dead handle(s)" << std::endl;
                     
-                    // Update focused handle if it was removed
-                    if (focusedHandleRemoved) {
+                    // The id of a removed handle no longer resolves, so focus can simply be checked through the store
+                    if (!self.get(currentFocusedHandle.load())) {
                         if (!self.empty()) {
                             setFocusedHandle(&self[0]);
                             LOG_INFO() << "Focused handle was removed, switched focus to first available handle" << std::endl;
@@ -4,11 +4,14 @@
 #include "types.h"
 #include "tcp.h"
 #include "guard.h"
+#include "slotmap.h"
 #include "font.h"
 
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <mutex>
+#include <atomic>
 
 
 namespace window {
@@ -22,6 +25,8 @@ namespace window {
         BOTTOM_LEFT, BOTTOM_RIGHT,  // anchored quarter of the screen at the bottom left or bottom right
     };
 
+    constexpr size_t positionCount = static_cast<size_t>(position::BOTTOM_RIGHT) + 1;
+
     // Forward declaration for the handle class
     class handle;
 
@@ -34,6 +39,13 @@ namespace window {
     extern types::rectangle positionToCellCoordinates(position pos, const handle& windowHandle);
     extern types::rectangle positionToCellCoordinates(position pos, uint32_t displayId = 0);
     
+    // Bumped whenever a window's preset or display changes, call invalidateLayout for anything else geometry depends on, like the cell size
+    extern std::atomic<uint64_t> layoutGeneration;
+    extern void invalidateLayout();
+
+    // Changes along with layoutGeneration and display::manager::configurationGeneration, geometry computed at another value is stale
+    extern uint64_t currentLayoutGeneration();
+
     // Utility functions for display management
     extern uint32_t getPrimaryDisplayId();
     extern bool isValidDisplayId(uint32_t displayId);
@@ -55,12 +67,67 @@ namespace window {
         }
     }
 
+    // Snapshot of what the renderer last drew for a handle, so only changed cells need to be re-rendered.
+    struct presentedState {
+        std::vector<types::Cell> cells;     // Cells as they currently are on the framebuffer
+        types::rectangle pixelArea;         // Pixel area the cells were drawn into
+        float zoom = 0.0f;                  // Zoom the cells were drawn with
+        bool valid = false;                 // False forces the next render to redraw every cell
+        std::vector<uint8_t> stale;         // Non-zero for cells another handle has drawn over since, empty if none are
+
+        void invalidate() { valid = false; }
+
+        // Forces a single cell to be redrawn even though it didn't change
+        void invalidate(size_t cell) {
+            if (stale.size() != cells.size()) {
+                stale.assign(cells.size(), 0);
+            }
+            stale[cell] = 1;
+        }
+
+        bool isStale(size_t cell) const { return !stale.empty() && stale[cell]; }
+    };
+
+    // Cells of a handle hidden behind handles drawn above it, recomputed by the renderer every frame.
+    struct coverage {
+        std::vector<uint8_t> hidden;    // Non-zero for every cell which is completely covered, empty if none are
+        size_t hiddenCount = 0;
+
+        bool isHidden(size_t cell) const { return !hidden.empty() && hidden[cell]; }
+        bool full() const { return hiddenCount != 0 && hiddenCount == hidden.size(); }
+    };
+
+    // Rows of a cell buffer which changed since the renderer last drew it.
+    struct rowSpan {
+        int begin = 0;
+        int end = 0;    // Exclusive
+
+        bool empty() const { return begin >= end; }
+
+        void include(int first, int last) {
+            if (empty()) {
+                begin = first;
+                end = last;
+            }
+            else {
+                begin = std::min(begin, first);
+                end = std::max(end, last);
+            }
+        }
+
+        void clear() { begin = end = 0; }
+    };
+
+    // Stable identifier of a handle, see handleStore
+    using handleId = slot::id;
+
     /*
     As each GGUI gets its input from the terminal hosting it. We currently need to first instate a new terminal and then host GGUI on top of it, for GGUI to get input from it.
     We can later on, give each handle Focused mode, and perpetrate the inputs from here and give them through sockets to each individual GGUI instance. 
     */
     class handle {
     public:
+        handleId id;    // Given by the handleStore holding this handle
         // I'm not sure where we can get the position of hosting terminal for the current GGUI handle, this will be more important once we start to give inputs from here and ditch terminal hosting.
         position preset;   // Z represents draw order, higher = later draw.
         position previousPreset;  // Previous position preset for resize stain system
@@ -80,12 +147,40 @@ namespace window {
         
         // Mutex to protect cellBuffer access between renderer and reception threads
         mutable std::mutex cellBufferMutex;
-        
+
+        // Damage tracking state owned by the renderer, also guarded by cellBufferMutex
+        mutable presentedState presented;
+
+        // Rows poll has written to since the last render, also guarded by cellBufferMutex
+        mutable rowSpan changedRows;
+
+        // What the handles above leave of this one, owned by the renderer and also guarded by cellBufferMutex
+        mutable coverage visibility;
+
         // Display management - track which display this handle is positioned on
         uint32_t displayId;  // ID of the display this handle is associated with
 
         std::unique_ptr<font::font> customFont = nullptr;
 
+        // Scratch space for packet payloads which don't go straight into cellBuffer, only ever grows so polling doesn't allocate
+        std::vector<char> receiveBuffer;
+
+        // Parser state of the framed protocol, survives partial reads between polls
+        tcp::frameReader reader;
+        std::vector<types::Cell> incomingCells;     // Draw buffer being received, swapped with cellBuffer once complete
+        bool receivingCells = false;                // Whether the current frame is being received into incomingCells
+        bool deltaBaseValid = false;                // Whether cellBuffer holds a full frame of the current size for deltas to patch
+
+        // Cells written by a local client straight into shared memory, see packet::shared
+        tcp::sharedRing sharedCells;
+
+        // Latest encoded draw buffer received while completely covered, only decoded once some of it shows again
+        std::vector<char> deferredEncoded;
+        size_t deferredEncodedLength = 0;   // Zero if nothing is deferred
+
+        // Upper bound of frames handled per poll, so one chatty client can't stall the frame for everyone else
+        constexpr static unsigned int maxFramesPerPoll = 8;
+
         handle(tcp::connection&& conn) : preset(position::FULLSCREEN), previousPreset(position::FULLSCREEN), errorCount(0), dirty(stain::type::clear), zoom(1.0f), connection(std::move(conn)), name(""), cellBuffer(new std::vector<types::Cell>()), displayId(0) {}
 
         ~handle() {
@@ -97,10 +192,12 @@ namespace window {
         
         // Custom move constructor
         handle(window::handle&& other) noexcept 
-            : preset(other.preset), previousPreset(other.previousPreset), errorCount(other.errorCount), 
+            : id(other.id), preset(other.preset), previousPreset(other.previousPreset), errorCount(other.errorCount), 
               dirty(other.dirty), zoom(other.zoom), connection(std::move(other.connection)), 
-              name(std::move(other.name)), cellBuffer(other.cellBuffer), displayId(other.displayId),
-              customFont(std::move(other.customFont)) {
+              name(std::move(other.name)), cellBuffer(other.cellBuffer), presented(std::move(other.presented)), changedRows(other.changedRows),
+              visibility(std::move(other.visibility)), displayId(other.displayId), customFont(std::move(other.customFont)), receiveBuffer(std::move(other.receiveBuffer)),
+              reader(other.reader), incomingCells(std::move(other.incomingCells)), receivingCells(other.receivingCells), deltaBaseValid(other.deltaBaseValid),
+              sharedCells(std::move(other.sharedCells)), deferredEncoded(std::move(other.deferredEncoded)), deferredEncodedLength(other.deferredEncodedLength) {
             other.cellBuffer = nullptr;  // Take ownership
         }
         
@@ -111,6 +208,7 @@ namespace window {
                 delete cellBuffer;
                 
                 // Move all members
+                id = other.id;
                 preset = other.preset;
                 previousPreset = other.previousPreset;
                 errorCount = other.errorCount;
@@ -119,8 +217,19 @@ namespace window {
                 connection = std::move(other.connection);
                 name = std::move(other.name);
                 cellBuffer = other.cellBuffer;
+                presented = std::move(other.presented);
+                changedRows = other.changedRows;
+                visibility = std::move(other.visibility);
                 displayId = other.displayId;
                 customFont = std::move(other.customFont);
+                receiveBuffer = std::move(other.receiveBuffer);
+                reader = other.reader;
+                incomingCells = std::move(other.incomingCells);
+                receivingCells = other.receivingCells;
+                deltaBaseValid = other.deltaBaseValid;
+                sharedCells = std::move(other.sharedCells);
+                deferredEncoded = std::move(other.deferredEncoded);
+                deferredEncodedLength = other.deferredEncodedLength;
                 
                 // Clear the other object
                 other.cellBuffer = nullptr;
@@ -135,6 +244,15 @@ namespace window {
         // polls from GGUI dimensions and cell buffer
         void poll();
 
+        // Swaps a completely received frame in incomingCells into cellBuffer
+        void commitIncomingCells(int rows);
+
+        // Decodes the deferred encoded draw buffer if there is one, returns false if it was malformed or made for another size
+        bool decodeDeferred();
+
+        // Patches cellBuffer with the spans of a DRAW_DELTA payload, returns false if nothing was applied
+        bool applyDelta(const char* payload, size_t length, int rowWidth);
+
         font::font* getFont() const;
 
         // for staining
@@ -145,24 +263,129 @@ namespace window {
         // Resize stain system - get area that needs to be cleared
         types::rectangle getResizeClearArea() const;
         
-        // Display management methods
-        void setDisplayId(uint32_t newDisplayId) { displayId = newDisplayId; }
+        // Layout changes go through these, so cached geometry and the draw order know to follow
+        void setPreset(position newPreset) { preset = newPreset; invalidateLayout(); }
+        void setDisplayId(uint32_t newDisplayId) { displayId = newDisplayId; invalidateLayout(); }
         uint32_t getDisplayId() const { return displayId; }
-        types::rectangle getCoordinates() const { return positionToCellCoordinates(preset, *this); }
-        types::rectangle getPixelCoordinates() const { return positionToPixelCoordinates(preset, *this); }
-        types::rectangle getCellCoordinates() const { return positionToCellCoordinates(preset, *this); }
-        
+        types::rectangle getCoordinates() const { return getGeometry().cells; }
+        types::rectangle getPixelCoordinates() const { return getGeometry().pixels; }
+        types::rectangle getCellCoordinates() const { return getGeometry().cells; }
+
     private:
-        // Helper method to flush TCP receive buffer to prevent misalignment
-        void flushTcpReceiveBuffer();
+        // Rectangles of the current preset and display, recomputed only after the layout has changed
+        struct geometryCache {
+            uint64_t generation = 0;    // layoutGeneration the rectangles belong to, zero never matches
+            types::rectangle cells;
+            types::rectangle pixels;
+        };
+
+        mutable geometryCache geometry;
+        mutable std::mutex geometryMutex;   // The renderer, input and config threads all ask for geometry
+
+        geometryCache getGeometry() const;
+    };
+
+    /*
+    Owns the handles behind stable ids, so focus and input can refer to a window no matter how the others come and go.
+    Iterating and indexing go through a separate draw order of ids, so reordering windows never moves a handle.
+    */
+    class handleStore {
+        slot::map<handle> slots;
+        std::vector<handleId> drawOrder;    // Lower z first
+        uint64_t sortedGeneration = 0;      // layoutGeneration the draw order was last sorted at
+        bool orderDirty = false;            // Handles were added since the last sort
+    public:
+        class iterator {
+            const handleStore* store;
+            std::vector<handleId>::const_iterator position;
+        public:
+            iterator(const handleStore* owner, std::vector<handleId>::const_iterator at) : store(owner), position(at) {}
+
+            handle& operator*() const { return store->slots.at(*position); }
+            handle* operator->() const { return &store->slots.at(*position); }
+            iterator& operator++() { ++position; return *this; }
+            bool operator==(const iterator& other) const { return position == other.position; }
+            bool operator!=(const iterator& other) const { return position != other.position; }
+        };
+
+        // Adds a handle on top of the draw order
+        template<typename... Args>
+        handle& emplace(Args&&... args) {
+            handleId newId = slots.emplace(std::forward<Args>(args)...);
+            drawOrder.push_back(newId);
+            orderDirty = true;
+
+            handle& added = slots.at(newId);
+            added.id = newId;
+            return added;
+        }
+
+        // nullptr once the handle has been removed
+        handle* get(handleId target) const { return slots.get(target); }
+
+        // Removes every handle the predicate matches, returns how many were removed
+        template<typename Predicate>
+        size_t removeIf(Predicate predicate) {
+            size_t before = drawOrder.size();
+
+            drawOrder.erase(std::remove_if(drawOrder.begin(), drawOrder.end(), [this, &predicate](handleId target) {
+                if (!predicate(slots.at(target))) {
+                    return false;
+                }
+                slots.erase(target);
+                return true;
+            }), drawOrder.end());
+
+            return before - drawOrder.size();
+        }
+
+        // Reorders the draw order only, the handles themselves stay where they are. Does nothing unless handles were added or the layout changed since the last sort.
+        template<typename Compare>
+        void sort(Compare compare) {
+            uint64_t generation = currentLayoutGeneration();
+            if (!orderDirty && generation == sortedGeneration) {
+                return;
+            }
+
+            auto byHandle = [this, &compare](handleId a, handleId b) { return compare(slots.at(a), slots.at(b)); };
+
+            if (!std::is_sorted(drawOrder.begin(), drawOrder.end(), byHandle)) {
+                std::stable_sort(drawOrder.begin(), drawOrder.end(), byHandle);
+            }
+
+            sortedGeneration = generation;
+            orderDirty = false;
+        }
+
+        void clear() {
+            drawOrder.clear();
+            slots.clear();
+        }
+
+        const std::vector<handleId>& order() const { return drawOrder; }
+
+        // Index into the draw order
+        handle& operator[](size_t index) const { return slots.at(drawOrder[index]); }
+
+        size_t size() const { return drawOrder.size(); }
+        bool empty() const { return drawOrder.empty(); }
+
+        iterator begin() const { return iterator(this, drawOrder.begin()); }
+        iterator end() const { return iterator(this, drawOrder.end()); }
     };
 
     // Manages all of the handles and their handshake protocol steps.
     namespace manager {
-        extern atomic::guard<std::vector<handle>> handles;
+        extern atomic::guard<handleStore> handles;
+
+        // Watches the sockets of all handles, so the renderer only wakes up for the ones with new data.
+        extern tcp::reactor connections;
         
         // First we will make an listener with port number zero, to invoke the kernel giving us an empty port number to use.
         extern atomic::guard<tcp::listener> listener;
+
+        // Unix domain listener for local clients, which connect straight to it without the port exchange. Not listening if the socket couldn't be created.
+        extern atomic::guard<tcp::listener> localListener;
         
         // Shutdown control
         extern std::atomic<bool> shouldShutdown;
@@ -172,7 +395,7 @@ namespace window {
         
         // Focus management for input system
         extern void setFocusedHandle(handle* focusedHandle);
-        extern handle* getFocusedHandle();
+        extern handleId getFocusedHandleId();
         extern void setFocusedHandleByIndex(size_t index);
         extern void setFocusOnNextAvailableHandle();
         extern size_t getActiveHandleCount();
@@ -191,11 +414,14 @@ namespace window {
             PRIMARY_ONLY,   // All handles go to primary display
             FILL_THEN_NEXT  // Fill one display before moving to next
         };
-        extern void assignDisplaysToHandles(std::vector<handle>& windowHandles);
-        extern void fitHandlesToDisplay(std::vector<handle>& windowHandles, std::vector<uint32_t>& displayIds);
+        extern void assignDisplaysToHandles(handleStore& windowHandles);
+
+        // Turns connections which finished their handshake into handles, called by the renderer while it holds handles exclusively
+        extern void adoptArrivals(handleStore& windowHandles);
+        extern void fitHandlesToDisplay(handleStore& windowHandles, std::vector<uint32_t>& displayIds);
         
         // Professional tiling layout helper function
-        extern void applyTilingLayout(std::vector<handle>& windowHandles, const std::vector<size_t>& windowIndices, uint32_t displayId);
+        extern void applyTilingLayout(handleStore& windowHandles, const std::vector<size_t>& windowIndices, uint32_t displayId);
 
         // New window assignment controller
         extern void assignNewWindowToDisplay(handle& newHandle, position pos);